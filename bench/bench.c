@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// Generates a corpus of workloads, runs proj1 over each of them and
+// reports throughput, time per expansion and peak RSS. With -b the
+// results are checked against a stored baseline.
+//
+//	bench [-n runs] [-d dir] [-b baseline] [-w] [-t pct] [-m pct] proj1
+
+#define WARN(format, ...) fprintf(stderr, "bench: " format "\n", __VA_ARGS__)
+#define DIE(format, ...) WARN(format, __VA_ARGS__), exit(2)
+
+#define DEFAULT_RUNS 5
+#define DEFAULT_SPEED_SLACK 10		// % of speed that may be lost
+#define DEFAULT_RSS_SLACK 25		// % of peak RSS that may be gained
+
+#define MAX_NAME 32
+
+typedef struct
+{
+	const char *name;
+	long (*generate)(FILE *fp, const char *dir);	// returns expansions
+} workload_t;
+
+typedef struct
+{
+	char name[MAX_NAME];
+	double mbps;
+	double nsPerExpansion;
+	long rssKb;
+} result_t;
+
+// Text that needs no expanding, a line at a time
+static const char *words[] = {
+	"lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+	"elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+	"[et]", "(dolore)", "magna", "aliqua", "1+1=2"
+};
+
+void writeLine(FILE *fp, int wordCount)
+{
+	int i;
+
+	for (i = 0; i < wordCount; i++)
+		fprintf(fp, "%s%s", i ? " " : "", words[rand() % (sizeof(words) / sizeof(words[0]))]);
+
+	fputc('\n', fp);
+}
+
+// 32MB of plain text, with the odd escape and group
+long genPassthrough(FILE *fp, const char *dir)
+{
+	long expansions = 0;
+
+	(void) dir;
+
+	while (ftell(fp) < 32L * 1024 * 1024)
+	{
+		writeLine(fp, 12);
+
+		if (rand() % 16 == 0)
+		{
+			fputs("\\{braced\\} {group of words} \\%\n", fp);
+			expansions += 3;
+		}
+	}
+
+	return expansions;
+}
+
+// Each R<k> expands to two R<k - 1>, so \R<depth> is 2^(depth + 1) - 1
+// expansions
+long genRecursive(FILE *fp, const char *dir)
+{
+	int depth = 16, calls = 8, k;
+
+	(void) dir;
+
+	fputs("\\def{R0}{(#)}\n", fp);
+	for (k = 1; k <= depth; k++)
+		fprintf(fp, "\\def{R%d}{\\R%d{#}\\R%d{#}}\n", k, k - 1, k - 1);
+
+	for (k = 0; k < calls; k++)
+		fprintf(fp, "\\R%d{x%d}\n", depth, k);
+
+	return depth + 1 + calls * ((1L << (depth + 1)) - 1);
+}
+
+// Definitions that come and go, under many names
+long genDefs(FILE *fp, const char *dir)
+{
+	int cycles = 200000, names = 4096, i;
+
+	(void) dir;
+
+	for (i = 0; i < cycles; i++)
+		fprintf(fp, "\\def{M%d}{body %d [#]}\\M%d{arg}\\undef{M%d}\n",
+			i % names, i, i % names, i % names);
+
+	return 3L * cycles;
+}
+
+// h<k> includes h<k / 2>, the main file includes them all at random
+long includeDepth(int k)
+{
+	return k ? 1 + includeDepth(k / 2) : 1;
+}
+
+long genInclude(FILE *fp, const char *dir)
+{
+	int headers = 64, includes = 40000, i, k;
+	long expansions = 0;
+	char path[4096];
+	FILE *hp;
+
+	for (k = 0; k < headers; k++)
+	{
+		snprintf(path, sizeof(path), "%s/h%d", dir, k);
+		if (!(hp = fopen(path, "w")))
+			DIE("Unable to write %s", path);
+
+		fprintf(hp, "header %d {\\{group\\}}\n", k);
+		if (k)
+			fprintf(hp, "\\include{h%d}\n", k / 2);
+
+		fclose(hp);
+	}
+
+	for (i = 0; i < includes; i++)
+	{
+		k = rand() % headers;
+		fprintf(fp, "\\include{h%d}\n", k);
+		expansions += includeDepth(k);
+	}
+
+	return expansions;
+}
+
+// \expandafter nested in the argument expanded first, chainLength deep
+long genExpandafter(FILE *fp, const char *dir)
+{
+	int chains = 4000, chainLength = 24, i, k;
+
+	(void) dir;
+
+	fputs("\\def{A}{a#}\n", fp);
+
+	for (i = 0; i < chains; i++)
+	{
+		for (k = 0; k < chainLength; k++)
+			fprintf(fp, "\\expandafter{%d}{", k);
+
+		fputs("\\A{x}", fp);
+
+		for (k = 0; k < chainLength; k++)
+			fputc('}', fp);
+
+		fputc('\n', fp);
+	}
+
+	return 1 + (long) chains * (chainLength + 1);
+}
+
+// Mostly comments, some of them inside groups
+long genComments(FILE *fp, const char *dir)
+{
+	long expansions = 0;
+
+	(void) dir;
+
+	while (ftell(fp) < 16L * 1024 * 1024)
+	{
+		fputs("% ", fp);
+		writeLine(fp, 10);
+		fputs("   text after a comment\n", fp);
+
+		if (rand() % 8 == 0)
+		{
+			fputs("{group % comment in a group\n  continued}\n", fp);
+			expansions++;
+		}
+	}
+
+	return expansions;
+}
+
+static const workload_t workloads[] = {
+	{ "passthrough", genPassthrough },
+	{ "recursive", genRecursive },
+	{ "defs", genDefs },
+	{ "include", genInclude },
+	{ "expandafter", genExpandafter },
+	{ "comments", genComments },
+};
+
+#define WORKLOAD_COUNT ((int) (sizeof(workloads) / sizeof(workloads[0])))
+
+double nowSeconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run proj1 on input (in dir) once, returns the wall time. *rssKb is
+// set to the peak RSS of the run.
+double runOnce(const char *proj1, const char *dir, const char *input, long *rssKb)
+{
+	struct rusage usage;
+	double start = nowSeconds();
+	int status, fd;
+	pid_t pid;
+
+	if ((pid = fork()) < 0)
+		DIE("%s", "Unable to fork");
+
+	if (!pid)
+	{
+		if (chdir(dir) || (fd = open("/dev/null", O_WRONLY)) < 0 || dup2(fd, STDOUT_FILENO) < 0)
+			_exit(127);
+
+		execl(proj1, proj1, input, (char *) NULL);
+		_exit(127);
+	}
+
+	while (wait4(pid, &status, 0, &usage) < 0)
+		if (errno != EINTR)
+			DIE("%s", "Unable to wait for proj1");
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		DIE("proj1 failed on %s", input);
+
+	*rssKb = usage.ru_maxrss;
+
+	return nowSeconds() - start;
+}
+
+int readBaseline(const char *path, result_t *base)
+{
+	FILE *fp = fopen(path, "r");
+	int count = 0;
+
+	if (!fp)
+		DIE("Unable to read baseline %s", path);
+
+	while (count < WORKLOAD_COUNT && fscanf(fp, "%31s %lf %lf %ld", base[count].name,
+		&base[count].mbps, &base[count].nsPerExpansion, &base[count].rssKb) == 4)
+		count++;
+
+	fclose(fp);
+
+	return count;
+}
+
+void writeBaseline(const char *path, result_t *results)
+{
+	FILE *fp = fopen(path, "w");
+	int i;
+
+	if (!fp)
+		DIE("Unable to write baseline %s", path);
+
+	for (i = 0; i < WORKLOAD_COUNT; i++)
+		fprintf(fp, "%s %.6g %.6g %ld\n", results[i].name, results[i].mbps,
+			results[i].nsPerExpansion, results[i].rssKb);
+
+	fclose(fp);
+}
+
+// Returns the number of regressions. Speed is MB/s, or expansions/s
+// for a workload too small to measure in MB/s.
+int compare(result_t *results, result_t *base, int baseCount, int speedSlack, int rssSlack)
+{
+	int i, j, regressions = 0;
+	double speed, rss;
+
+	for (i = 0; i < WORKLOAD_COUNT; i++)
+	{
+		for (j = 0; j < baseCount && strcmp(base[j].name, results[i].name); j++)
+			;
+
+		if (j == baseCount)
+		{
+			printf("%-12s  not in the baseline\n", results[i].name);
+			continue;
+		}
+
+		if (base[j].mbps >= 1 || !results[i].nsPerExpansion)
+			speed = results[i].mbps / base[j].mbps;
+		else speed = base[j].nsPerExpansion / results[i].nsPerExpansion;
+
+		rss = (double) results[i].rssKb / base[j].rssKb;
+
+		printf("%-12s  %+7.1f%% speed  %+7.1f%% RSS", results[i].name, 100 * (speed - 1), 100 * (rss - 1));
+
+		if (speed < (100 - speedSlack) / 100.0 || rss > (100 + rssSlack) / 100.0)
+		{
+			printf("  REGRESSION");
+			regressions++;
+		}
+
+		putchar('\n');
+	}
+
+	return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+	result_t results[WORKLOAD_COUNT], base[WORKLOAD_COUNT];
+	int runs = DEFAULT_RUNS, speedSlack = DEFAULT_SPEED_SLACK, rssSlack = DEFAULT_RSS_SLACK;
+	int opt, write = 0, i, r, baseCount;
+	char *dir = NULL, *baseline = NULL, *proj1, tmpDir[] = "/tmp/proj1-bench-XXXXXX";
+	char input[4096];
+	long expansions, rssKb;
+	double best, seconds;
+	struct stat st;
+	FILE *fp;
+
+	while ((opt = getopt(argc, argv, "n:d:b:wt:m:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n': runs = atoi(optarg); break;
+			case 'd': dir = optarg; break;
+			case 'b': baseline = optarg; break;
+			case 'w': write = 1; break;
+			case 't': speedSlack = atoi(optarg); break;
+			case 'm': rssSlack = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-n runs] [-d dir] [-b baseline [-w]] [-t pct] [-m pct] proj1\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (optind != argc - 1 || runs < 1 || (write && !baseline))
+		DIE("%s", "Expected the path to proj1 (and -b with -w)");
+
+	if (!(proj1 = realpath(argv[optind], NULL)))
+		DIE("No proj1 at %s", argv[optind]);
+
+	if (!dir && !(dir = mkdtemp(tmpDir)))
+		DIE("%s", "Unable to make a directory for the corpus");
+
+	printf("%-12s  %9s  %8s  %9s  %10s  %10s\n", "workload", "input MB", "best s", "MB/s", "ns/exp", "peak RSS KB");
+
+	for (i = 0; i < WORKLOAD_COUNT; i++)
+	{
+		// The same corpus every time
+		srand(i + 1);
+
+		snprintf(input, sizeof(input), "%s/%s", dir, workloads[i].name);
+		if (!(fp = fopen(input, "w")))
+			DIE("Unable to write %s", input);
+
+		expansions = workloads[i].generate(fp, dir);
+		fclose(fp);
+
+		if (stat(input, &st))
+			DIE("Unable to stat %s", input);
+
+		best = 0;
+		results[i].rssKb = 0;
+
+		for (r = 0; r < runs; r++)
+		{
+			seconds = runOnce(proj1, dir, workloads[i].name, &rssKb);
+
+			if (!r || seconds < best)
+				best = seconds;
+
+			if (rssKb > results[i].rssKb)
+				results[i].rssKb = rssKb;
+		}
+
+		snprintf(results[i].name, MAX_NAME, "%s", workloads[i].name);
+		results[i].mbps = st.st_size / (1024.0 * 1024) / best;
+		results[i].nsPerExpansion = expansions ? best * 1e9 / expansions : 0;
+
+		printf("%-12s  %9.1f  %8.3f  %9.1f  %10.1f  %10ld\n", results[i].name,
+			st.st_size / (1024.0 * 1024), best, results[i].mbps,
+			results[i].nsPerExpansion, results[i].rssKb);
+		fflush(stdout);
+	}
+
+	free(proj1);
+
+	if (!baseline)
+		return 0;
+
+	if (write)
+	{
+		writeBaseline(baseline, results);
+		return 0;
+	}
+
+	baseCount = readBaseline(baseline, base);
+	putchar('\n');
+
+	if ((r = compare(results, base, baseCount, speedSlack, rssSlack)))
+	{
+		printf("%d regression(s) against %s\n", r, baseline);
+		return 1;
+	}
+
+	return 0;
+}
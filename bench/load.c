@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+// Keeps a proj1 --serve socket busy: each connection sends the same
+// document over and over, waiting for the whole reply every time, and
+// the throughput and latencies of all the requests are reported.
+//
+//	load [-c connections] [-n requests] -s socket document
+
+#define WARN(format, ...) fprintf(stderr, "load: " format "\n", __VA_ARGS__)
+#define DIE(format, ...) WARN(format, __VA_ARGS__), exit(2)
+
+#define DEFAULT_CONNECTIONS 4
+#define DEFAULT_REQUESTS 1000		// per connection
+
+typedef struct
+{
+	pthread_t thread;
+	const char *socket;
+	const char *document;
+	uint32_t length;
+	int requests;
+	double *latencies;		// seconds, one per request
+	long bytes;				// of output received
+	long errors;			// requests the server failed
+} client_t;
+
+double nowSeconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void sendAll(int fd, const void *data, size_t len)
+{
+	ssize_t n;
+
+	while (len)
+	{
+		if ((n = send(fd, data, len, MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			DIE("%s", "Unable to send a request");
+		}
+
+		data = (const char *) data + n;
+		len -= n;
+	}
+}
+
+void recvAll(int fd, void *data, size_t len)
+{
+	ssize_t n;
+
+	while (len)
+	{
+		if ((n = recv(fd, data, len, 0)) <= 0)
+		{
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			DIE("%s", "The server hung up");
+		}
+
+		data = (char *) data + n;
+		len -= n;
+	}
+}
+
+uint32_t recvLength(int fd)
+{
+	uint32_t length;
+
+	recvAll(fd, &length, sizeof(length));
+
+	return ntohl(length);
+}
+
+// One request: the document out, frames of output back until the empty
+// one, then the error
+void request(client_t *client, int fd, char *buf, size_t bufSize)
+{
+	uint32_t length = htonl(client->length), n;
+
+	sendAll(fd, &length, sizeof(length));
+	sendAll(fd, client->document, client->length);
+
+	while ((n = recvLength(fd)))
+	{
+		client->bytes += n;
+
+		for (; n > bufSize; n -= bufSize)
+			recvAll(fd, buf, bufSize);
+
+		recvAll(fd, buf, n);
+	}
+
+	if ((n = recvLength(fd)))
+	{
+		client->errors++;
+
+		for (; n > bufSize; n -= bufSize)
+			recvAll(fd, buf, bufSize);
+
+		recvAll(fd, buf, n);
+	}
+}
+
+void *runClient(void *arg)
+{
+	client_t *client = arg;
+	struct sockaddr_un addr;
+	char buf[64 * 1024];
+	double start;
+	int fd, i;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", client->socket);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+		DIE("Unable to connect to %s", client->socket);
+
+	for (i = 0; i < client->requests; i++)
+	{
+		start = nowSeconds();
+		request(client, fd, buf, sizeof(buf));
+		client->latencies[i] = nowSeconds() - start;
+	}
+
+	close(fd);
+
+	return NULL;
+}
+
+int compareDoubles(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+// Reads the whole document into memory
+char *readDocument(const char *path, uint32_t *length)
+{
+	FILE *fp = fopen(path, "rb");
+	char *data;
+	long size;
+
+	if (!fp || fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET))
+		DIE("Unable to read %s", path);
+
+	if (!(data = malloc(size + 1)) || fread(data, 1, size, fp) != (size_t) size)
+		DIE("Unable to read %s", path);
+
+	fclose(fp);
+	*length = size;
+
+	return data;
+}
+
+int main(int argc, char *argv[])
+{
+	int connections = DEFAULT_CONNECTIONS, requests = DEFAULT_REQUESTS;
+	int opt, i, total;
+	char *socket = NULL, *document;
+	double *latencies, start, seconds;
+	long bytes = 0, errors = 0;
+	client_t *clients;
+	uint32_t length;
+
+	while ((opt = getopt(argc, argv, "c:n:s:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'c': connections = atoi(optarg); break;
+			case 'n': requests = atoi(optarg); break;
+			case 's': socket = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-c connections] [-n requests] -s socket document\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (optind != argc - 1 || !socket || connections < 1 || requests < 1)
+		DIE("%s", "Expected -s socket and the document to send");
+
+	document = readDocument(argv[optind], &length);
+	total = connections * requests;
+
+	if (!(clients = calloc(connections, sizeof(client_t))) || !(latencies = malloc(total * sizeof(double))))
+		DIE("%s", "Bad memory");
+
+	start = nowSeconds();
+
+	for (i = 0; i < connections; i++)
+	{
+		clients[i].socket = socket;
+		clients[i].document = document;
+		clients[i].length = length;
+		clients[i].requests = requests;
+		clients[i].latencies = latencies + i * requests;
+
+		if (pthread_create(&clients[i].thread, NULL, runClient, clients + i))
+			DIE("%s", "Unable to start a client");
+	}
+
+	for (i = 0; i < connections; i++)
+	{
+		pthread_join(clients[i].thread, NULL);
+		bytes += clients[i].bytes;
+		errors += clients[i].errors;
+	}
+
+	seconds = nowSeconds() - start;
+	qsort(latencies, total, sizeof(double), compareDoubles);
+
+	printf("%d requests on %d connections in %.3f s: %.1f req/s, %.1f MB/s out, %ld failed\n",
+		total, connections, seconds, total / seconds, bytes / (1024.0 * 1024) / seconds, errors);
+	printf("latency ms: p50 %.3f  p99 %.3f  max %.3f\n", latencies[total / 2] * 1e3,
+		latencies[(int) (total * 0.99)] * 1e3, latencies[total - 1] * 1e3);
+
+	free(latencies);
+	free(clients);
+	free(document);
+
+	return 0;
+}
@@ -0,0 +1,765 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <arpa/inet.h>
+
+#include "proj1.h"
+
+// The proj1 command, on top of the library: expands the files given
+// (stdin if there are none) to stdout, or every file on its own with
+// --batch, or documents sent to it with --serve.
+
+#define WARN(format, ...) fprintf(stderr, "proj1: " format "\n", __VA_ARGS__)
+#define DIE(format, ...) WARN(format, __VA_ARGS__), exit(EXIT_FAILURE)
+
+#define STATS_TEXT 1				// --stats
+#define STATS_JSON 2				// --stats=json
+#define TRACE_MIN_US 10				// spans --trace leaves out, by default
+
+#define BATCH_SUFFIX ".out"			// --batch writes file to file.out
+#define CACHE_MAX (256L * 1024 * 1024)	// bytes --cache keeps, by default
+
+#define FRAME_STREAM 1				// --serve=-: frames on stdin and stdout
+#define FRAME_SOCKET 2				// --serve=path: frames on a connection
+#define INIT_CLIENTS 8
+#define REPLY_MAX 512				// of an error sent back to a client
+#define SEND_TIMEOUT_MS 10000		// a client not reading its reply is dropped
+
+// Where a write callback sends the output. A --serve reply sends every
+// write as a frame (its length first).
+typedef struct
+{
+	int fd;
+	int framed;				// FRAME_STREAM or FRAME_SOCKET
+} output_t;
+
+// A --serve connection, and as much of its next request as has come in
+typedef struct
+{
+	int fd;
+	uint32_t header;		// the length, in network order
+	uint32_t len;			// of the document, once the header is in
+	uint32_t got;			// of the header, then of the document
+	char *body;				// NULL until the header is in
+} client_t;
+
+// Where --trace sends the events of every context (on any thread): one
+// JSON array
+typedef struct
+{
+	FILE *fp;
+	pthread_mutex_t lock;
+	long events;
+	long minUs;				// --trace-min
+} trace_t;
+
+// A --batch worker's share of the documents. It takes them from the
+// back; the other workers steal from the front once they run out.
+typedef struct
+{
+	pthread_mutex_t lock;
+	int front, back;		// documents [front, back) are left
+} deque_t;
+
+typedef struct
+{
+	char **files;			// one document each
+	deque_t *deques;		// one per worker
+	int workers;
+	proj1_limits_t *limits;
+	proj1_image_t *image;	// --load-snapshot, shared by every worker
+	trace_t *trace;			// NULL without --trace
+	char *cache;			// NULL without --cache
+} batch_t;
+
+typedef struct
+{
+	batch_t *batch;
+	int id;
+	int failed;				// documents
+	pthread_t thread;
+} worker_t;
+
+long parseLimit(char *arg, char *option);
+void reportStderr(void *user, const char *message);
+void writeTrace(void *user, const char *event);
+void openTrace(trace_t *trace, char *path);
+void flushTrace(trace_t *trace);
+void closeTrace(trace_t *trace);
+ssize_t readFd(void *user, char *buf, size_t len);
+int writeAll(int fd, int socket, struct iovec *iov, int count);
+int writeOutput(void *user, const struct iovec *iov, int count);
+int discardOutput(void *user, const struct iovec *iov, int count);
+proj1_t *createContext(proj1_limits_t *limits, proj1_image_t *image, trace_t *trace, char *cache);
+int expandDocument(proj1_t *base, char *file);
+int takeDocument(batch_t *batch, int id);
+void *runWorker(void *arg);
+int runBatch(char **files, int fileCount, int workers, proj1_limits_t *limits, proj1_image_t *image, trace_t *trace, char *cache);
+ssize_t readFull(int fd, char *dst, size_t len);
+char *readFrame(int fd, uint32_t *len);
+int serveFrame(proj1_t *server, char *body, uint32_t len, int out, int framed, trace_t *trace);
+int serveRequest(proj1_t *server, int in, int out, int framed, trace_t *trace);
+int readClient(proj1_t *server, client_t *client, trace_t *trace);
+_Noreturn void runServer(proj1_t *server, char *path, trace_t *trace);
+
+// The value of a --max-...=N option
+long parseLimit(char *arg, char *option)
+{
+	char *end;
+	long value;
+
+	errno = 0;
+	value = strtol(arg + strlen(option), &end, 10);
+
+	if (errno || end == arg + strlen(option) || *end || value < 0)
+		DIE("%s%s", "Bad value for ", arg);
+
+	return value;
+}
+
+// What the library reports, with user (if any) in front
+void reportStderr(void *user, const char *message)
+{
+	fprintf(stderr, "proj1: %s%s", user ? (char *) user : "", message);
+}
+
+void writeTrace(void *user, const char *event)
+{
+	trace_t *trace = user;
+
+	pthread_mutex_lock(&trace->lock);
+	fprintf(trace->fp, "%s%s", trace->events++ ? ",\n" : "[\n", event);
+	pthread_mutex_unlock(&trace->lock);
+}
+
+void openTrace(trace_t *trace, char *path)
+{
+	if (!(trace->fp = fopen(path, "w")))
+		DIE("%s%s", "Unable to create ", path);
+}
+
+// What a server has traced so far is on disk between requests
+void flushTrace(trace_t *trace)
+{
+	pthread_mutex_lock(&trace->lock);
+	fflush(trace->fp);
+	pthread_mutex_unlock(&trace->lock);
+}
+
+// End the array (a trace cut short, by a --serve=path that is killed,
+// is still read without it)
+void closeTrace(trace_t *trace)
+{
+	fprintf(trace->fp, "%s", trace->events ? "\n]\n" : "[]\n");
+
+	if (fclose(trace->fp))
+		WARN("%s", "Unable to write the trace");
+}
+
+ssize_t readFd(void *user, char *buf, size_t len)
+{
+	return read(*(int *) user, buf, len);
+}
+
+// All of iov to fd (a socket, without raising SIGPIPE if it is gone)
+int writeAll(int fd, int socket, struct iovec *iov, int count)
+{
+	struct msghdr msg;
+	ssize_t n;
+
+	while (count > 0)
+	{
+		if (socket)
+		{
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = count;
+			n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		}
+		else n = writev(fd, iov, count);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		// Skip what made it out, resume a partial write
+		for (; count > 0 && (size_t) n >= iov->iov_len; iov++, count--)
+			n -= iov->iov_len;
+
+		if (count > 0)
+		{
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+int writeOutput(void *user, const struct iovec *iov, int count)
+{
+	output_t *out = user;
+	struct iovec frame[PROJ1_IOV + 1];
+	uint32_t header;
+	size_t len = 0;
+	int i;
+
+	memcpy(frame + 1, iov, count * sizeof(struct iovec));
+
+	if (!out->framed)
+		return writeAll(out->fd, 0, frame + 1, count);
+
+	// Length first
+	for (i = 0; i < count; i++)
+		len += iov[i].iov_len;
+
+	header = htonl(len);
+	frame[0].iov_base = &header;
+	frame[0].iov_len = sizeof(header);
+
+	return writeAll(out->fd, out->framed == FRAME_SOCKET, frame, count + 1);
+}
+
+// Only the definitions are kept (a --serve prelude)
+int discardOutput(void *user, const struct iovec *iov, int count)
+{
+	(void) user;
+	(void) iov;
+	(void) count;
+
+	return 0;
+}
+
+// A context reporting on stderr (and tracing, with trace, and keeping
+// output in cache), with limits set and image loaded. Exits if it can't
+// be had.
+proj1_t *createContext(proj1_limits_t *limits, proj1_image_t *image, trace_t *trace, char *cache)
+{
+	proj1_t *ctx = proj1Create();
+
+	if (!ctx)
+		DIE("%s", "Bad memory createContext\n");
+
+	proj1SetReport(ctx, reportStderr, NULL);
+	proj1SetLimits(ctx, limits);
+
+	if (trace)
+		proj1SetTrace(ctx, writeTrace, trace, trace->minUs);
+
+	proj1SetCache(ctx, cache);
+
+	if (image && proj1LoadSnapshot(ctx, image))
+		exit(EXIT_FAILURE);
+
+	return ctx;
+}
+
+// Expand file into file.out, as if by itself (in a clone of base).
+// Returns 0 (and leaves no output) if it fails.
+int expandDocument(proj1_t *base, char *file)
+{
+	char *path = malloc(strlen(file) + sizeof(BATCH_SUFFIX)), *prefix = malloc(strlen(file) + 3);
+	output_t out = { -1, 0 };
+	proj1_t *doc;
+	int ok = 0;
+
+	if (!path || !prefix || !(doc = proj1Clone(base)))
+		DIE("%s", "Bad memory expandDocument\n");
+
+	sprintf(path, "%s%s", file, BATCH_SUFFIX);
+	sprintf(prefix, "%s: ", file);
+	proj1SetReport(doc, reportStderr, prefix);
+
+	if ((out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+		WARN("%s%s%s%s", prefix, "Unable to create ", path, "\n");
+	else
+	{
+		ok = proj1ExpandFiles(doc, &file, 1, writeOutput, &out) == PROJ1_OK;
+		close(out.fd);
+
+		if (!ok)
+			unlink(path);
+	}
+
+	proj1Destroy(doc);
+	free(prefix);
+	free(path);
+
+	return ok;
+}
+
+// Next document for worker id, -1 once there are none left anywhere
+int takeDocument(batch_t *batch, int id)
+{
+	deque_t *deque = batch->deques + id;
+	int doc = -1, i;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->front < deque->back)
+		doc = --deque->back;
+	pthread_mutex_unlock(&deque->lock);
+
+	// Out of work, steal from the others
+	for (i = 1; doc < 0 && i < batch->workers; i++)
+	{
+		deque = batch->deques + (id + i) % batch->workers;
+
+		pthread_mutex_lock(&deque->lock);
+		if (deque->front < deque->back)
+			doc = deque->front++;
+		pthread_mutex_unlock(&deque->lock);
+	}
+
+	return doc;
+}
+
+// Each document is a clone of the worker's context: the snapshot is
+// loaded once, the allocators and the include cache stay warm
+void *runWorker(void *arg)
+{
+	worker_t *worker = arg;
+	proj1_t *base = createContext(worker->batch->limits, worker->batch->image, worker->batch->trace,
+		worker->batch->cache);
+	int doc;
+
+	while ((doc = takeDocument(worker->batch, worker->id)) >= 0)
+		if (!expandDocument(base, worker->batch->files[doc]))
+			worker->failed++;
+
+	proj1Destroy(base);
+
+	return NULL;
+}
+
+// --batch: expand every file as a document of its own, on workers
+// threads. Returns how many failed.
+int runBatch(char **files, int fileCount, int workers, proj1_limits_t *limits, proj1_image_t *image, trace_t *trace, char *cache)
+{
+	batch_t batch = { files, NULL, workers < fileCount ? workers : fileCount, limits, image, trace, cache };
+	worker_t *worker;
+	int i, failed = 0;
+
+	if (!(batch.deques = calloc(batch.workers, sizeof(deque_t))) ||
+		!(worker = calloc(batch.workers, sizeof(worker_t))))
+		DIE("%s", "Bad memory runBatch\n");
+
+	for (i = 0; i < batch.workers; i++)
+	{
+		pthread_mutex_init(&batch.deques[i].lock, NULL);
+		batch.deques[i].front = (long) fileCount * i / batch.workers;
+		batch.deques[i].back = (long) fileCount * (i + 1) / batch.workers;
+
+		worker[i].batch = &batch;
+		worker[i].id = i;
+	}
+
+	for (i = 0; i < batch.workers; i++)
+		if (pthread_create(&worker[i].thread, NULL, runWorker, worker + i))
+			DIE("%s", "Unable to start a worker\n");
+
+	for (i = 0; i < batch.workers; i++)
+	{
+		pthread_join(worker[i].thread, NULL);
+		failed += worker[i].failed;
+	}
+
+	for (i = 0; i < batch.workers; i++)
+		pthread_mutex_destroy(&batch.deques[i].lock);
+
+	free(worker);
+	free(batch.deques);
+
+	return failed;
+}
+
+// Read exactly len bytes, less only at the end of the input
+ssize_t readFull(int fd, char *dst, size_t len)
+{
+	size_t got = 0;
+	ssize_t n;
+
+	while (got < len)
+	{
+		if ((n = read(fd, dst + got, len - got)) < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			break;
+
+		got += n;
+	}
+
+	return got;
+}
+
+// A request: its length (network order), then the document. NULL at
+// the end of the input, or if the frame is cut short.
+char *readFrame(int fd, uint32_t *len)
+{
+	uint32_t header;
+	char *body;
+
+	if (readFull(fd, (char *) &header, sizeof(header)) != sizeof(header))
+		return NULL;
+
+	header = ntohl(header);
+
+	if (header > INT_MAX - 1)
+	{
+		WARN("%s", "Request too large");
+		return NULL;
+	}
+
+	if (!(body = malloc(header + 1)))
+		DIE("%s", "Bad memory readFrame\n");
+
+	if (readFull(fd, body, header) != header)
+	{
+		free(body);
+		return NULL;
+	}
+
+	*len = header;
+
+	return body;
+}
+
+// Stream the expansion of the document body[0, len) to out (in a clone
+// of server, the prelude's context): frames of output, then an empty
+// frame and the error (a length and the message, empty if it went
+// through). Returns 0 once out is gone.
+int serveFrame(proj1_t *server, char *body, uint32_t len, int out, int framed, trace_t *trace)
+{
+	output_t output = { out, framed };
+	char reply[2 * sizeof(uint32_t) + REPLY_MAX];
+	uint32_t header[2];
+	const char *error;
+	proj1_t *doc;
+	int status;
+	ssize_t n;
+
+	if (!(doc = proj1Clone(server)))
+		DIE("%s", "Bad memory serveFrame\n");
+
+	status = proj1ExpandBuffer(doc, body, len, writeOutput, &output);
+	error = proj1Error(doc);
+
+	len = strlen(error);
+	if (len > sizeof(reply) - sizeof(header))
+		len = sizeof(reply) - sizeof(header);
+
+	header[0] = 0;
+	header[1] = htonl(len);
+	memcpy(reply, header, sizeof(header));
+	memcpy(reply + sizeof(header), error, len);
+	len += sizeof(header);
+
+	proj1Destroy(doc);
+
+	if (trace)
+		flushTrace(trace);
+
+	if (status == PROJ1_OUTPUT)
+		return 0;
+
+	while ((n = framed == FRAME_SOCKET ? send(out, reply, len, MSG_NOSIGNAL) : write(out, reply, len)) < 0 && errno == EINTR)
+		;
+
+	return n == (ssize_t) len;
+}
+
+// Read a request from in and serve it to out. Returns 0 once in is
+// done or out is gone.
+int serveRequest(proj1_t *server, int in, int out, int framed, trace_t *trace)
+{
+	uint32_t len;
+	char *body;
+	int served;
+
+	if (!(body = readFrame(in, &len)))
+		return 0;
+
+	served = serveFrame(server, body, len, out, framed, trace);
+	free(body);
+
+	return served;
+}
+
+// Take what the client has sent without waiting for more, and serve
+// its request once all of it is in. Returns 0 once the client is done
+// or gone.
+int readClient(proj1_t *server, client_t *client, trace_t *trace)
+{
+	int served;
+	ssize_t n;
+
+	for (;;)
+	{
+		if (!client->body)
+			n = recv(client->fd, (char *) &client->header + client->got, sizeof(client->header) - client->got, MSG_DONTWAIT);
+		else n = recv(client->fd, client->body + client->got, client->len - client->got, MSG_DONTWAIT);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+
+		// Gone, with or without a request cut short
+		if (!n)
+			return 0;
+
+		client->got += n;
+
+		if (!client->body)
+		{
+			if (client->got < sizeof(client->header))
+				continue;
+
+			if ((client->len = ntohl(client->header)) > INT_MAX - 1)
+			{
+				WARN("%s", "Request too large");
+				return 0;
+			}
+
+			if (!(client->body = malloc(client->len + 1)))
+				DIE("%s", "Bad memory readClient\n");
+
+			client->got = 0;
+		}
+
+		if (client->got < client->len)
+			continue;
+
+		// Back to poll after each request, so one client can't keep
+		// the others waiting
+		served = serveFrame(server, client->body, client->len, client->fd, FRAME_SOCKET, trace);
+		free(client->body);
+		client->body = NULL;
+		client->got = 0;
+
+		return served;
+	}
+}
+
+// Serve connections on a Unix socket at path, one request at a time.
+// Requests are read as they come in, a client only holds the others up
+// while its request is being expanded.
+void runServer(proj1_t *server, char *path, trace_t *trace)
+{
+	struct timeval timeout = { SEND_TIMEOUT_MS / 1000, SEND_TIMEOUT_MS % 1000 * 1000 };
+	struct sockaddr_un addr;
+	struct pollfd *fds;
+	client_t *clients;
+	int listener, fd, count = 1, capacity = INIT_CLIENTS, i;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		DIE("%s%s", "Socket path too long: ", path);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	// A socket left behind by an earlier server
+	unlink(path);
+
+	if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listener, SOMAXCONN) < 0)
+		DIE("%s%s", "Unable to listen on ", path);
+
+	if (!(fds = malloc(capacity * sizeof(struct pollfd))) || !(clients = malloc(capacity * sizeof(client_t))))
+		DIE("%s", "Bad memory runServer\n");
+
+	fds[0].fd = listener;
+	fds[0].events = POLLIN;
+
+	for (;;)
+	{
+		if (poll(fds, count, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			DIE("%s", "Unable to poll clients\n");
+		}
+
+		for (i = 1; i < count; i++)
+		{
+			if (!fds[i].revents)
+				continue;
+
+			if ((fds[i].revents & POLLIN) && readClient(server, clients + i, trace))
+				continue;
+
+			close(fds[i].fd);
+			free(clients[i].body);
+			clients[i] = clients[--count];
+			fds[i--] = fds[count];
+		}
+
+		if ((fds[0].revents & POLLIN) && (fd = accept(listener, NULL, NULL)) >= 0)
+		{
+			if (count == capacity && (!(fds = realloc(fds, (capacity *= 2) * sizeof(struct pollfd))) ||
+				!(clients = realloc(clients, capacity * sizeof(client_t)))))
+				DIE("%s", "Bad memory runServer\n");
+
+			// A reply blocks the server while it is sent
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+			memset(clients + count, 0, sizeof(client_t));
+			clients[count].fd = fd;
+			fds[count].fd = fd;
+			fds[count].events = POLLIN;
+			fds[count++].revents = 0;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int arg, batch = 0, parallel = 0, jobs = sysconf(_SC_NPROCESSORS_ONLN), stats = 0, failed = 0;
+	int in = STDIN_FILENO;
+	char *serve = NULL, *loadPath = NULL, *savePath = NULL, *tracePath = NULL, *cache = NULL;
+	long cacheMax = CACHE_MAX;
+	output_t out = { STDOUT_FILENO, 0 };
+	trace_t trace = { NULL, PTHREAD_MUTEX_INITIALIZER, 0, TRACE_MIN_US };
+	proj1_limits_t limits = { 0, 0, 0, 0 };
+	proj1_image_t *image = NULL;
+	proj1_t *ctx;
+
+	// Options come before the files, "--" ends them
+	for (arg = 1; arg < argc && !strncmp(argv[arg], "--", 2); arg++)
+	{
+		if (!strcmp(argv[arg], "--"))
+		{
+			arg++;
+			break;
+		}
+		else if (!strcmp(argv[arg], "--stats"))
+			stats = STATS_TEXT;
+		else if (!strcmp(argv[arg], "--stats=json"))
+			stats = STATS_JSON;
+		else if (!strncmp(argv[arg], "--trace=", 8))
+			tracePath = argv[arg] + 8;
+		else if (!strncmp(argv[arg], "--trace-min=", 12))
+			trace.minUs = parseLimit(argv[arg], "--trace-min=");
+		else if (!strncmp(argv[arg], "--max-expansions=", 17))
+			limits.expansions = parseLimit(argv[arg], "--max-expansions=");
+		else if (!strncmp(argv[arg], "--max-stack=", 12))
+			limits.stackBytes = parseLimit(argv[arg], "--max-stack=");
+		else if (!strncmp(argv[arg], "--max-include-depth=", 20))
+			limits.includeDepth = parseLimit(argv[arg], "--max-include-depth=");
+		else if (!strncmp(argv[arg], "--max-time=", 11))
+			limits.timeMs = parseLimit(argv[arg], "--max-time=");
+		else if (!strcmp(argv[arg], "--batch"))
+			batch = 1;
+		else if (!strcmp(argv[arg], "--parallel"))
+			parallel = 1;
+		else if (!strncmp(argv[arg], "--load-snapshot=", 16))
+			loadPath = argv[arg] + 16;
+		else if (!strncmp(argv[arg], "--save-snapshot=", 16))
+			savePath = argv[arg] + 16;
+		else if (!strncmp(argv[arg], "--cache=", 8))
+			cache = argv[arg] + 8;
+		else if (!strncmp(argv[arg], "--cache-max=", 12))
+			cacheMax = parseLimit(argv[arg], "--cache-max=");
+		else if (!strncmp(argv[arg], "--serve=", 8))
+			serve = argv[arg] + 8;
+		else if (!strncmp(argv[arg], "--jobs=", 7))
+		{
+			if (!(jobs = parseLimit(argv[arg], "--jobs=")))
+				DIE("%s%s", "Bad value for ", argv[arg]);
+		}
+		else DIE("%s%s", "Unknown option ", argv[arg]);
+	}
+
+	if (serve && (batch || stats || savePath || cache))
+		DIE("%s", "--serve can't be used with --batch, --stats, --save-snapshot or --cache\n");
+
+	if (batch && arg == argc)
+		DIE("%s", "--batch needs the files to expand\n");
+
+	if (batch && stats)
+		DIE("%s", "--stats can't be used with --batch\n");
+
+	if (batch && savePath)
+		DIE("%s", "--save-snapshot can't be used with --batch\n");
+
+	// --batch already has a thread per document
+	if (parallel && (batch || serve))
+		DIE("%s", "--parallel can't be used with --batch or --serve\n");
+
+	// Output replayed from the cache defines nothing
+	if (cache && savePath)
+		DIE("%s", "--save-snapshot can't be used with --cache\n");
+
+	if (cache && mkdir(cache, 0777) && errno != EEXIST)
+		DIE("%s%s", "Unable to create ", cache);
+
+	if (tracePath)
+		openTrace(&trace, tracePath);
+
+	ctx = createContext(&limits, NULL, tracePath ? &trace : NULL, cache);
+
+	if (loadPath && (!(image = proj1MapSnapshot(ctx, loadPath)) || proj1LoadSnapshot(ctx, image)))
+		return EXIT_FAILURE;
+
+	if (serve)
+	{
+		// The prelude's macros are where every request starts from
+		if (arg < argc && proj1ExpandFiles(ctx, argv + arg, argc - arg, discardOutput, NULL))
+			return EXIT_FAILURE;
+
+		if (strcmp(serve, "-"))
+			runServer(ctx, serve, tracePath ? &trace : NULL);
+
+		while (serveRequest(ctx, STDIN_FILENO, STDOUT_FILENO, FRAME_STREAM, tracePath ? &trace : NULL))
+			;
+	}
+	else if (batch)
+		failed = runBatch(argv + arg, argc - arg, jobs > 0 ? jobs : 1, &limits, image, tracePath ? &trace : NULL, cache);
+	else
+	{
+		proj1SetStats(ctx, stats);
+		proj1SetParallel(ctx, parallel && jobs > 0 ? jobs : 1);
+
+		if (arg == argc)
+			failed = proj1ExpandStream(ctx, readFd, &in, writeOutput, &out);
+		else failed = proj1ExpandFiles(ctx, argv + arg, argc - arg, writeOutput, &out);
+
+		if (!failed && stats)
+			failed = proj1PrintStats(ctx, stderr, stats == STATS_JSON);
+
+		if (!failed && savePath)
+			failed = proj1SaveSnapshot(ctx, savePath);
+	}
+
+	if (cache)
+		proj1TrimCache(ctx, cacheMax);
+
+	proj1Destroy(ctx);
+	proj1UnmapSnapshot(image);
+
+	if (tracePath)
+		closeTrace(&trace);
+
+	return failed ? EXIT_FAILURE : 0;
+}
@@ -1,7 +1,38 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "proj1.h"
+
+#if defined(__SSE2__) || (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+#include <immintrin.h>
+#endif
+
+// Literal runs are scanned 32 bytes at a time when the CPU has AVX2
+// (checked at run time), else 16 with SSE2, else a byte at a time.
+// -DSCAN_SCALAR always uses the byte loop, -DSCAN_NO_AVX2 stops at SSE2,
+// -DSCAN_CHECK checks every vector scan against the byte loop.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(SCAN_SCALAR) && \
+	!defined(SCAN_NO_AVX2)
+#define SCAN_AVX2
+#endif
+#if defined(__SSE2__) && !defined(SCAN_SCALAR)
+#define SCAN_SSE2
+#endif
 
 #define ESCAPE '\\'
 #define ARGUMENT '#'
@@ -10,11 +41,16 @@
 #define BRACE_CLOSE '}'
 #define COMMENT_START '%'
 
+#define CLASS_SPECIAL 1				// stands for itself after ESCAPE
+#define CLASS_PRESERVED 2			// stays escaped in the output
+#define CLASS_LEX 4					// ends a literal run for the lexer
+#define CLASS_SPACE 8				// isspace() in the C locale
+
 #define BRACE_OPEN_STR "{"
 #define BRACE_CLOSE_STR "}"
 
-#define WARN(format, ...) fprintf(stderr, "proj1: " format "\n", __VA_ARGS__)
-#define DIE(format, ...) WARN(format, __VA_ARGS__), exit(EXIT_FAILURE)
+#define WARN(format, ...) report(format "\n", __VA_ARGS__)
+#define DIE(format, ...) WARN(format, __VA_ARGS__), fail(PROJ1_ERROR)
 
 #define NOT_FOUND 	-1
 #define DEF			0
@@ -25,82 +61,1006 @@
 #define EXPANDAFTER	5
 
 #define INIT_MACRO_CAPACITY 8
+#define INIT_TABLE_SIZE 16
+#define EMPTY_SLOT -1
 #define PROTECTED_MACROS 6
 #define INIT_BUF 1024
 
+#define READ_BLOCK (256 * 1024)
+#define LOOKAHEAD 4					// chunks a macro may look at
+#define RANGE_BLOCK (16 * 1024)		// longer text is chunked as it is reached
+
+#define SINK_BUF (64 * 1024)		// flush once this much is queued
+#define SINK_IOV PROJ1_IOV			// iovecs per write
+#define SINK_DIRECT 512				// runs at least this long skip staging
+#define SINK_FLUSH_MS 50			// flush at least this often
+
+#define INIT_INCLUDES 8
+#define INIT_MEMO 64				// buckets
+#define INIT_RECORDS 8
+#define MEMO_SEEN 4096				// calls remembered as made once
+#define MEMO_BYTES (4 * 1024 * 1024)	// kept of the expansions, at most
+#define MEMO_ENTRY_MAX (64 * 1024)	// longest expansion kept
+#define INIT_GROUPS 16
+#define INDEX_DEPTH 3				// groups nested deeper get brace index entries
+
+#define ARENA_BLOCK (64 * 1024)
+#define ARENA_ALIGN 16
+#define SMALL_STRING 48				// buffers shorter than this live in the pool
+
+#define STORE_HEAP 0				// where a string_t's charAt lives
+#define STORE_MAP 1
+#define STORE_POOL 2
+#define STORE_CALLER 3
+
+#define TOKEN_TEXT 0				// what a chunk is (its kind)
+#define TOKEN_NEWLINE 1
+#define TOKEN_ESCAPE 2				// an ESCAPE on its own
+#define TOKEN_ESCAPED 3				// starts with an escaped character
+#define TOKEN_WORD 4				// a control word (\name)
+#define TOKEN_GROUP 5
+#define TOKEN_MARK 6				// where an expansion being recorded ends
+#define TOKEN_RANGE 7				// text not chunked yet
+
+#define TOKEN_BALANCED 1			// a whole group, as the lexer matched it and
+									// isValidArg counts it
+#define TOKEN_UNESCAPED 2			// nothing in it to unescape
+
+#define CHAIN_SHOWN 16				// frames named when a limit is reached
+#define CLOCK_STEPS 1024			// steps between looks at the clock
+
+#define SNAPSHOT_MAGIC "PROJ1IMG"
+#define SNAPSHOT_VERSION 1			// bump whenever the layout changes
+#define SNAPSHOT_VIEW -1			// a chunk in the image is a view of the text
+
+#define CACHE_MAGIC "PROJ1DEP"
+#define CACHE_VERSION 2				// bump whenever the manifest layout changes
+#define CACHE_SEMANTICS 1			// bump whenever a document may expand differently
+#define CACHE_NAME (2 * DIGEST_SIZE + 5)	// a digest in hex, its suffix and the NUL
+#define DIGEST_SIZE 32				// SHA-256
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define INIT_DEPS 64
+#define DEP_DEFINED 0				// what a document depended on
+#define DEP_UNDEFINED 1
+#define DEP_FILE 2
+
+#define PARALLEL_SEGMENT (256 * 1024)	// least a segment expanded ahead takes
+#define PARALLEL_SEGMENTS 8			// per thread, in a document large enough
+#define PARALLEL_MAX 64				// threads a document is expanded on, at most
+
+#define ERROR_MAX 512				// of proj1Error's message
+#define TRACE_NAME 96				// kept of a span's name
+#define TRACE_EVENT 512				// longest trace event
+#define INIT_SPANS 16
+
 // TODO: Check for NULL pointers
 
+typedef struct block
+{
+	struct block *next;
+	size_t size;
+	size_t used;
+} block_t;
+
+#define BLOCK_HEADER ((sizeof(block_t) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+// Bump allocator. Memory only goes back all at once: to a mark taken
+// earlier (the blocks are kept for reuse) or when the arena is
+// destroyed.
 typedef struct
 {
-	char *value;
+	block_t *first;
+	block_t *current;
+} arena_t;
+
+typedef struct
+{
+	block_t *block;
+	size_t used;
+} mark_t;
+
+// Objects of one size, carved from an arena and recycled through a
+// free list
+typedef struct
+{
+	arena_t arena;
+	size_t size;
+	void *free;
+} pool_t;
+
+typedef struct
+{
+	struct template *body;	// compiled value, NULL when not defined
 	char *name;
+	int nameLen;
+	unsigned int hash;
+	int defined;
 } macro_t;
 
+// Names are interned: a name keeps its id (and its slot in the
+// hash table) for the life of the table, undef only clears the
+// definition. Lookups never allocate and never probe over holes.
 typedef struct
 {
-	macro_t **arr;
-	int capacity;
-	int index;
-	int size;
+	macro_t **arr;		// id -> interned name (+ definition)
+	int *slots;			// open addressing (linear probing) of ids
+	int tableSize;		// power of 2
+	int capacity;		// of arr
+	int index;			// number of interned names (next id)
+	int size;			// number of defined macros
+	arena_t arena;		// the macro_ts and their names
+	long generation;	// bumped whenever a definition comes or goes
+	long documents;		// expanded with it so far
+	struct memo *memo;	// NULL until a custom macro is called
 } macrolist_t;
 
+// A group in a brace index
+typedef struct
+{
+	int open, close;		// offsets of the group's braces
+	int next;				// entry after those of the groups inside it
+							// (while open, the entry of the group around it)
+	int plain;				// no comment inside, so its chunk is a view
+	int miscounted;			// a brace after an escaped ESCAPE inside
+} group_t;
+
+// Groups of a buffer nested more than INDEX_DEPTH deep, in the order
+// they open, as found by lexChunks the first time it goes over them.
+// When the contents of the group around one are chunked, it is taken
+// whole from its entry instead of being gone over again, so text is
+// gone over at most INDEX_DEPTH + 1 times however deep it is nested
+// (and shallow documents have no index at all).
+typedef struct
+{
+	int end;				// of the text gone over so far
+	int clean;				// the text before has no NUL (chunks stop at one)
+	int count;
+	int capacity;
+	group_t groups[];
+} braceindex_t;
+
+// Shared, reference counted buffer. Chunks on the pending-input stack
+// are slices into these, so text is never copied just to move it
+// between stacks. refs counts the references besides the creator's.
 typedef struct
 {
 	char *charAt;
 	int length;
+	int refs;
+	int storage;		// STORE_HEAP, STORE_MAP (a read-only mmap of a
+						// whole file), STORE_POOL (right after it) or
+						// STORE_CALLER (proj1ExpandBuffer's, left alone)
+	braceindex_t *braces;	// NULL until a group is found deep enough
 } string_t;
 
+// A piece of pending input: a view of length len into buf (not NUL
+// terminated). buf is NULL for static text ("{", "}", ...).
 typedef struct node
 {
 	char *data;
+	int len;
+	unsigned char kind;		// TOKEN_TEXT, ..., from its first characters
+	unsigned char flags;	// TOKEN_BALANCED, ..., where the lexer knows
+	string_t *buf;
 	struct node *next;
+	struct frame *frame;	// with frames on, the expansion it came from
 } node_t;
 
+// Part of a macro body that has to be chunked with the argument in,
+// and the chunks of the body after it that can be reused as they are
+typedef struct
+{
+	int from, to;			// range of the body, to == -1 for up to its end
+	int fromSlots, toSlots;	// slots before from and to
+	node_t *chunks;			// from to up to the next part
+} tpart_t;
+
+// A macro value, compiled by def() into chunks with slots (#) in
+// between. Chunking can start over after a newline or a group at the
+// top level (see lexChunks), so only the text from such a point before
+// a slot up to one after it has to be chunked again on every call; the
+// rest of the body is chunked here once.
+typedef struct template
+{
+	string_t *text;
+	int *slots;				// offsets of the #s in text
+	int slotCount;
+	node_t *chunks;			// up to the first part
+	tpart_t *parts;
+	int partCount;
+	int refs;				// besides the creator's (clones share them)
+} template_t;
+
+// What a call of a custom macro expanded to, for a macro table
+// generation: text holds the argument (braces and all), then the output
+typedef struct memoentry
+{
+	struct memoentry *chain;	// next in its bucket
+	struct memoentry *newer, *older;
+	unsigned int hash;
+	int macro;
+	long generation;
+	long document;			// it was recorded in
+	int argLen;
+	string_t *text;
+} memoentry_t;
+
+// Expansions of calls made more than once, so a call made again (with
+// nothing defined or undefined since) is written out instead of being
+// expanded. The least recently used go once they take MEMO_BYTES.
+typedef struct memo
+{
+	memoentry_t **buckets;
+	int bucketCount;		// power of 2
+	int count;
+	long bytes;				// of the texts
+	memoentry_t *newest, *oldest;
+	unsigned int seen[MEMO_SEEN];	// calls (and the generation), by their low bits
+	long hits;
+	long misses;
+	long evictions;
+} memo_t;
+
+// A call being recorded for the memo. It is done when processChunks
+// gets to mark, unless its expansion has looked past mark (for
+// arguments) by then.
+typedef struct
+{
+	node_t *mark;			// NULL once given up on
+	int macro;
+	unsigned int hash;
+	long generation;		// of the table when the call was made
+	long document;
+	long includes;			// \includes made before it
+	int start;				// of its output in the sink's recorded, -1 once given up on
+} record_t;
+
+// Input still to be read: a read callback or the files, in order, read
+// a block at a time. carry holds the unfinished tail of the last block.
+// Regular files are mapped instead, and chunked where they lie.
+typedef struct
+{
+	char **names;
+	char **files;			// next in names
+	int fileCount;
+	proj1_read_t read;		// instead of the files
+	void *user;
+	int fd;					// current input (0 for read), -1 once all is read
+	string_t *map;			// the current input, when it could be mapped
+	int mapPos;				// how far into map has been chunked
+	string_t *carry;
+	int carryStart;
+} source_t;
+
 typedef struct
 {
 	node_t *head;
 	int size;
+	long bytes;				// of the chunks on it
+	source_t *src;			// refills the bottom of the stack
+	struct frame *frame;	// with frames on, the expansion of this step
+	long stepStart;			// ns
+	long stepNested;		// stats.attributedNs when the step started
+	node_t *stop;			// processChunks returns once it is the head
 } stack_t;
 
-macro_t *createMacro(char *name, char *value);
+// Where finished text goes. Chunks that need no escaping and follow
+// each other in the same buffer (plain text of a mapped file, mostly)
+// are gathered into a run, which is queued in place if it gets long
+// enough. Everything else is staged in buf. Both are written out
+// together with writev once enough has piled up (or enough time has
+// passed). Without a write callback the chunks are captured (unescaped)
+// instead, for \expandafter.
+typedef struct sink
+{
+	proj1_write_t write;
+	void *user;
+	stack_t *chunks;		// captured chunks, most recent first
+	char *buf;
+	int len;
+	int broken;				// nothing more is written
+	struct iovec iov[SINK_IOV];
+	int iovCount;
+	long pending;			// bytes queued in iov
+	node_t *pinned;			// chunks queued in place
+	node_t *run;			// first chunk of the run being gathered
+	int runLen;
+	long lastFlush;			// ms
+	record_t *records;		// calls being recorded, innermost last
+	int recordCount;
+	int recordCapacity;
+	int live;				// records not given up on
+	char *recorded;			// output since the outermost one started
+	int recordedLen;
+	node_t *held;			// a chunk being written, while a write may fail
+	stack_t *input;			// a capture's: what is expanded into it
+	node_t *after;			// a capture's: what it goes in front of
+	struct sink *outer;		// a capture's: the one it is nested in
+} sink_t;
+
+// What the output cache knows files, outputs and macro values by. A
+// SHA-256 digest: two different ones never meet in practice, where a
+// 64-bit hash of a large cache could.
+typedef struct
+{
+	unsigned char bytes[DIGEST_SIZE];
+} digest_t;
+
+// A SHA-256 digest being taken
+typedef struct
+{
+	uint32_t state[8];
+	uint64_t len;			// bytes taken so far
+	unsigned char block[64];
+} digester_t;
+
+// A file read by \include, chunked once. Later includes replay (copies
+// of) its chunks, which are views of text.
+typedef struct
+{
+	char *path;				// canonical
+	struct timespec mtime;
+	off_t size;
+	string_t *text;
+	node_t *chunks;
+	long checked;			// epoch the file was last stat'ed in
+	int hashed;				// content is text's (for the output cache)
+	digest_t content;
+} incfile_t;
+
+typedef struct
+{
+	char *name;				// as given to \include, or a canonical path
+	int nameLen;
+	unsigned int hash;
+	incfile_t *file;
+} incname_t;
+
+// Files read by \include, by name. Both the names they were included
+// by and their canonical paths map to the file, so resolving a name
+// costs a realpath only the first time and two names for the same file
+// share its chunks. A file is stat'ed again (and reread if it changed)
+// only once per epoch.
+typedef struct
+{
+	incname_t **arr;
+	int *slots;				// open addressing (linear probing) of arr
+	int tableSize;			// power of 2
+	int capacity;			// of arr
+	int index;				// number of names
+	incfile_t **files;
+	int fileCount;
+	long epoch;
+	long hits;
+	long misses;
+} includes_t;
+
+// A macro invocation, for --stats and the limits: chunks remember the
+// one they came out of, and so the chain of invocations that led to
+// them. A macro invoked straight from its own expansion shares a frame
+// with the invocation before, so a recursion does not grow the chain.
+typedef struct frame
+{
+	int macro;
+	int repeat;				// invocations folded into this one
+	int refs;				// besides the creator's
+	int depth;				// frames up to the top level, this one too
+	long serial;			// the invocation's, kept by those folded in
+	struct frame *parent;
+} frame_t;
+
+typedef struct
+{
+	long calls;
+	long cumulativeNs;		// its steps and those of what it expanded to
+	long selfNs;
+	long bytes;				// output by chunks it expanded to directly
+	long stamp;				// last step counted towards cumulativeNs
+} macrostats_t;
+
+// Counters for --stats. Nothing is counted (or timed) unless enabled.
+// A step is one turn of processChunks; its time goes to the invocation
+// its first chunk came out of, less the time of any steps nested in it
+// (\expandafter).
+typedef struct
+{
+	int enabled;			// proj1SetStats
+	macrostats_t *macros;	// by macro id
+	int capacity;
+	macrostats_t top;		// text outside any macro
+	long steps;
+	long attributedNs;		// time of the steps so far
+	long lexNs;
+	long outputNs;
+	long totalNs;
+	long chunksLexed;
+	long chunksReplayed;	// copies of compiled or cached chunks
+	int peakStack;
+} stats_t;
+
+// An invocation being traced: open from the step that makes it until a
+// step comes out of something else than it (or what it expanded to)
+typedef struct
+{
+	long serial;			// its frame's
+	int depth;
+	int macro;
+	int repeat;
+	long start;
+	int argBytes;			// its arguments as written, braces and all
+	char name[TRACE_NAME];
+} span_t;
+
+// --trace: spans handed to emit as Chrome trace events as they end.
+// Nothing is traced (or timed for it) unless emit is set.
+typedef struct
+{
+	proj1_trace_t emit;
+	void *user;
+	long minNs;				// shorter spans are left out
+	long callStart;
+	long serials;			// frames made so far
+	span_t *open;			// invocations still going, outermost first
+	int openCount;
+	int openCapacity;
+} trace_t;
+
+// Runaway input is stopped by these, 0 for no limit. The clock is
+// only looked at every CLOCK_STEPS steps.
+typedef struct
+{
+	int on;					// any limit set
+	long expansions;		// macro invocations
+	long expanded;			// so far
+	long stackBytes;		// pending in a stack
+	int includeDepth;
+	long timeMs;
+	long deadline;			// nowMs() when timeMs is up
+	long steps;
+} limits_t;
+
+// A macro table saved by --save-snapshot, for --load-snapshot to map
+// instead of expanding the \defs again. The header is followed by the
+// defined macros, each as its name, its value and its compiled
+// template (slots, parts and chunks as offsets), in native ints kept
+// 4-byte aligned. The image is only good for the build that wrote it.
+// The output cache's manifests have the same header.
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t count;			// of macros (of dependencies, in a manifest)
+	uint64_t size;			// of the rest
+	uint64_t checksum;		// FNV-1a of the rest
+} imghead_t;
+
+// An image being written (data grows) or read (mapped, pos moves on)
+typedef struct proj1image
+{
+	char *data;
+	size_t len;
+	size_t cap;
+	size_t pos;
+} image_t;
+
+// Something a document kept in the output cache depended on: a macro
+// name and what its first lookup found, or a file it included
+typedef struct
+{
+	int kind;				// DEP_DEFINED, DEP_UNDEFINED or DEP_FILE
+	char *name;
+	int nameLen;
+	unsigned int hash;		// of the name (and whether it is a file's)
+	digest_t content;		// of the macro's value or of the file
+} dep_t;
+
+// What a document expanded for the output cache has depended on so
+// far, and the file its output is copied to as it is written. Only the
+// first lookup of a name counts: a document looks a name up before it
+// defines or undefines it, so that is what the name was when it started.
+typedef struct
+{
+	dep_t *arr;
+	int count;
+	int capacity;
+	int *slots;				// open addressing (linear probing) of arr
+	int tableSize;			// power of 2
+	char *seen;				// macro ids already counted
+	int seenCount;
+	arena_t names;
+	const char *dir;
+	digest_t key;
+	proj1_write_t write;	// the caller's
+	void *user;
+	char *tmp;				// the output so far, NULL once kept
+	int fd;					// -1 once it can't be kept
+	int warned;
+} deps_t;
+
+// One of the output cache's files, for trimCache
+typedef struct
+{
+	char name[CACHE_NAME];
+	off_t size;
+	struct timespec used;
+} cachefile_t;
+
+// What a segment expanded ahead left a macro as: its value, or NULL if
+// it undefined it
+typedef struct
+{
+	char *name;				// in the segment's deps
+	int nameLen;
+	char *value;
+} redef_t;
+
+// A stretch of a document, up to just after a newline at the top
+// level, expanded ahead on its own. Nothing it expands can take an
+// argument from past its end (an argument is a group, a newline at the
+// top level is not part of one), so if it expands on its own it would
+// have expanded the same in place, as long as its lookups find the same.
+typedef struct
+{
+	int start, end;			// in the document
+	char *out;				// its output (NUL terminated)
+	int len;
+	int cap;
+	deps_t *deps;			// its first lookups, NULL unless it expanded
+							// without a warning
+	redef_t *redefs;		// the names it left other than it found them
+	int redefCount;
+} segment_t;
+
+// A large document being expanded in parallel (see expandParallel):
+// its segments, and those of the wave being expanded ahead, each from
+// an image of the table as the wave started
+typedef struct
+{
+	const char *text;
+	segment_t *segments;
+	int count;
+	int first;				// of the wave
+	int last;				// past the wave
+	int next;				// the first no thread has taken yet
+	pthread_mutex_t lock;
+	image_t *image;
+	long generation;		// of the table the image is of
+} wave_t;
+
+// Everything a document being expanded holds on to (besides the
+// context's macros and includes)
+typedef struct
+{
+	stack_t *stack;
+	sink_t *out;
+	source_t *src;
+	deps_t *deps;			// NULL unless it is to be kept in the cache
+	wave_t *wave;			// NULL unless it is expanded in parallel
+	sink_t *nested;			// innermost \expandafter capture being expanded
+} document_t;
+
+// A context's allocators, shared with its clones
+typedef struct
+{
+	pool_t nodePool;
+	pool_t stringPool;
+	pool_t framePool;
+	arena_t scratch;
+} allocs_t;
+
+// What a call into a context takes over on its thread, and gives back
+// (another context may be in the middle of a call there)
+typedef struct
+{
+	proj1_t *ctx;
+	jmp_buf *failJump;
+	allocs_t allocs;
+	limits_t limits;
+	stats_t stats;
+	trace_t trace;
+	int framing;
+} state_t;
+
+struct proj1
+{
+	macrolist_t *macros;
+	includes_t *includes;	// base's for a clone
+	allocs_t *allocs;		// base's for a clone
+	proj1_t *base;			// NULL unless a clone
+	limits_t limits;		// as set, every call starts from these
+	stats_t stats;
+	trace_t trace;
+	proj1_report_t report;
+	void *reportUser;
+	char *cacheDir;			// proj1SetCache
+	int parallel;			// proj1SetParallel
+	document_t doc;			// being expanded
+	state_t saved;			// the thread's, during a call
+	mark_t mark;			// scratch when the call started
+	char error[ERROR_MAX];
+};
+
+// Nodes and buffer headers come and go with every chunk. Build with
+// -DNO_POOLS to use malloc for them instead (for memory checkers).
+// These, the rest of the allocators, the limits and the counters are
+// those of the context the thread is in a call to (see enter).
+static _Thread_local pool_t nodePool;
+static _Thread_local pool_t stringPool;
+
+// Temporaries of a single step, handed back with arenaRelease
+static _Thread_local arena_t scratch;
+
+static _Thread_local pool_t framePool;
+static _Thread_local stats_t stats;
+static _Thread_local trace_t trace;
+static _Thread_local limits_t limits;
+
+// DIE gives up on the call: fail() jumps back to the entry point, which
+// closes the document. Whatever a step holds on to while it may fail
+// is the document's to let go of then (see document_t and sink_t).
+static _Thread_local proj1_t *current;
+static _Thread_local jmp_buf *failJump;
+
+// Chunks carry frames (stats, trace or limits on)
+static _Thread_local int framing;
+
+// A trace's tracks: one per thread, numbered as they first trace
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static int traceThreads;
+static _Thread_local int traceThread;
+
+// Vector scanner picked once, before the first context is used
+static pthread_once_t scannerOnce = PTHREAD_ONCE_INIT;
+
+static const unsigned char charClass[256] = {
+	[ESCAPE] = CLASS_SPECIAL | CLASS_LEX,
+	[ARGUMENT] = CLASS_SPECIAL,
+	[BRACE_OPEN] = CLASS_SPECIAL | CLASS_LEX,
+	[BRACE_CLOSE] = CLASS_SPECIAL | CLASS_LEX,
+	[COMMENT_START] = CLASS_SPECIAL | CLASS_LEX,
+	[NEW_LINE] = CLASS_LEX | CLASS_SPACE,
+	[' '] = CLASS_SPACE, ['\t'] = CLASS_SPACE, ['\v'] = CLASS_SPACE,
+	['\f'] = CLASS_SPACE, ['\r'] = CLASS_SPACE,
+	['['] = CLASS_PRESERVED, [']'] = CLASS_PRESERVED,
+	['('] = CLASS_PRESERVED, [')'] = CLASS_PRESERVED,
+	['+'] = CLASS_PRESERVED, ['-'] = CLASS_PRESERVED,
+	['*'] = CLASS_PRESERVED, ['/'] = CLASS_PRESERVED,
+	['='] = CLASS_PRESERVED,
+};
+
+void report(const char *format, ...);
+_Noreturn void fail(int status);
+void *arenaAlloc(arena_t *arena, size_t size);
+mark_t arenaMark(arena_t *arena);
+void arenaRelease(arena_t *arena, mark_t mark);
+void destroyArena(arena_t *arena);
+void *poolAlloc(pool_t *pool);
+void poolFree(pool_t *pool, void *obj);
+macro_t *createMacro(macrolist_t *macros, char *name);
 macrolist_t *initMacros(void);
+macrolist_t *cloneMacros(macrolist_t *base);
 string_t *createString(char *str);
-int findMacro(char *str, macrolist_t *macros);
-int isValidArg(char *str);
-int isValidDefArg(char *str);
-int argIsAlnum(char *str);
-node_t *createNode(char *data, node_t *next);
+string_t *newString(int len);
+string_t *takeString(char *str, int len);
+string_t *retainString(string_t *str);
+unsigned int hashName(const char *name, int len);
+void putSlot(int **slots, int *size, int id, unsigned int hash, unsigned int (*hashOf)(void *table, int id), void *table);
+int lookupMacro(macrolist_t *macros, const char *name, int len);
+unsigned int macroHash(void *table, int id);
+int internMacro(macrolist_t *macros, const char *name, int len);
+int findMacro(char *str, int len, macrolist_t *macros);
+int isValidArg(node_t *node);
+int isValidDefArg(node_t *node);
+int argIsAlnum(char *str, int len);
+int tokenKind(char *data, int len);
+node_t *createNode(string_t *buf, char *data, int len, node_t *next);
+node_t *destroyNode(node_t *node);
+int copyChunks(node_t *chunks, node_t ***tail);
+void destroyChunks(node_t *chunks);
+long chunkBytes(node_t *chunks);
 stack_t *createStack();
-void push(stack_t *s, char *data);
-void pushString(stack_t *s, char *str, int from, int commentStart, int commentEnd, int len);
-char *pop(stack_t *s);
-void flipStack(stack_t *s1, stack_t *s2);
-int getStackTotalLength(stack_t *s);
-string_t *stackToString(stack_t *s);
+void pushNode(stack_t *s, node_t *node);
+void push(stack_t *s, string_t *buf, char *data, int len);
+void spliceChunks(stack_t *s, node_t *first, node_t **tail, int count);
+int skipLiteralScalar(const char *c, int n);
+int skipLiteral(const char *c, int n);
+char peekChar(char *c, int end, int i);
+int pushChunk(node_t ***tail, string_t *str, int end, int from, int commentStart, int commentEnd, int len, int flags);
+node_t *pop(stack_t *s);
 int isSpecialCharacter(char c);
-long getFileLength(FILE *fp);
-char *esc(char *str);
-char *escAll(char *str);
-char *removeBraces(char *str);
-void def(macrolist_t *macros, char *name, char *value);
+int isPreservedCharacter(char c);
+int unescape(char *dst, char *str, int len, int keep);
+int esc(char *dst, char *str, int len);
+int escAll(char *dst, char *str, int len);
+int escBoth(char *dst, char *str, int len);
+int bracesEnd(char *str, int len);
+char *removeBraces(char *str, int len, arena_t *arena);
+void def(macrolist_t *macros, char *name, int nameLen, char *value, int valueLen);
 void undef(macrolist_t *macros, int index);
-string_t *replace(char *original, char *value);
-void processChunks(stack_t *s, macrolist_t *macros, stack_t *out);
+template_t *compileTemplate(char *value);
+template_t *retainTemplate(template_t *tpl);
+template_t *destroyTemplate(template_t *tpl);
+void expandTemplate(template_t *tpl, char *arg, int argLen, stack_t *s);
+string_t *argContents(node_t *node, int *start, int *end);
+void chunkContents(node_t *node, stack_t *s);
+void chunkAfter(node_t *after, stack_t *before, stack_t *s);
+long nowMs(void);
+long nowNs(void);
+frame_t *retainFrame(frame_t *frame);
+frame_t *releaseFrame(frame_t *frame);
+void growStats(int count);
+void enterFrame(stack_t *s, int macro);
+void beginStep(stack_t *s);
+void endStep(stack_t *s);
+int includeDepth(frame_t *frame);
+void checkLimits(stack_t *s, macrolist_t *macros, int macro);
+void dieLimit(stack_t *s, macrolist_t *macros, char *what);
+int jsonString(char *dst, int cap, const char *str, int len);
+void traceSpan(char *cat, char *name, long start, long end, char *format, ...);
+void openSpan(stack_t *s, macrolist_t *macros, int macro);
+void closeSpans(frame_t *frame);
+void traceNested(stack_t *s, long start, int captured);
+sink_t *createSink(proj1_write_t write, void *user);
+void stageOutput(sink_t *out, char *data, int len);
+void endRun(sink_t *out);
+int sinkWrite(sink_t *out, node_t *node, int escaped);
+void writeChunk(sink_t *out, node_t *node, int escaped);
+void flushSink(sink_t *out);
+sink_t *destroySink(sink_t *out);
+memo_t *createMemo(void);
+memo_t *destroyMemo(memo_t *memo);
+unsigned int memoHash(int macro, char *arg, int len);
+memoentry_t *findMemo(memo_t *memo, int macro, unsigned int hash, char *arg, int len);
+void linkMemo(memo_t *memo, memoentry_t *entry);
+void unlinkMemo(memo_t *memo, memoentry_t *entry);
+void growMemo(memo_t *memo);
+void dropMemo(memo_t *memo, memoentry_t *entry);
+void storeMemo(memo_t *memo, record_t *record, char *data, int len);
+int memoCall(stack_t *s, macrolist_t *macros, includes_t *includes, sink_t *out, int macro, node_t *arg);
+void giveUpRecord(sink_t *out, record_t *record);
+void recordOutput(sink_t *out, char *data, int len);
+void finishRecord(sink_t *out, macrolist_t *macros, includes_t *includes, node_t *mark);
+int macroArgs(int macro);
+void reach(stack_t *s, sink_t *out, int count);
+int awaitInput(stack_t *s, sink_t *out, int n);
+void processChunks(stack_t *s, macrolist_t *macros, includes_t *includes, sink_t *out);
 void chunkString(string_t *str, stack_t *s);
+void chunkRange(string_t *str, int start, int end, stack_t *s);
+int openRange(stack_t *s, node_t **at);
+int openGroup(string_t *str, int open, int parent);
+int closeGroup(braceindex_t *index, int top, int close);
+int findGroup(braceindex_t *index, int offset);
+int skipGroup(string_t *str, int *cursor, int open, int end, int *flags);
+void dropGroups(braceindex_t *index, int offset);
+int lexChunks(string_t *str, int start, int end, int *safe, node_t ***tail);
+int lexBlock(string_t *str, int start, int end, int limit, int *safe, node_t ***tailp);
+source_t *createSource(char **files, int fileCount, proj1_read_t read, void *user);
+int openNextInput(source_t *src);
+string_t *mapFile(int fd);
+ssize_t readInput(source_t *src, char *dst, int n);
+int refillMapped(stack_t *s);
+int refill(stack_t *s);
+void fill(stack_t *s, int n);
+source_t *destroySource(source_t *src);
 string_t *readFile(char *filename);
 string_t *readString(char *str);
+includes_t *createIncludes(void);
+incname_t *lookupInclude(includes_t *includes, const char *name, int len);
+unsigned int includeHash(void *table, int id);
+incname_t *addInclude(includes_t *includes, const char *name, incfile_t *file);
+void loadInclude(incfile_t *file, struct stat *st);
+void includeFile(includes_t *includes, char *filename, stack_t *s);
+includes_t *destroyIncludes(includes_t *includes);
+int compareCumulative(const void *a, const void *b);
+void printStats(macrolist_t *macros, includes_t *includes, FILE *fp, int json);
+uint64_t hashImage(const char *data, size_t len);
+void digestBlock(uint32_t *state, const unsigned char *block);
+void startDigest(digester_t *d);
+void digestOn(digester_t *d, const void *data, size_t len);
+void endDigest(digester_t *d, digest_t *digest);
+void digestOf(const void *data, size_t len, digest_t *digest);
+void putImage(image_t *img, const void *data, size_t len);
+void putInt(image_t *img, int value);
+void putChunks(image_t *img, template_t *tpl, node_t *chunks);
+void putMacros(macrolist_t *macros, image_t *img, imghead_t *head);
+void saveSnapshot(macrolist_t *macros, const char *path);
+char *getImage(image_t *img, size_t len);
+int getInt(image_t *img);
+void getChunks(image_t *img, template_t *tpl, node_t **tail);
+image_t *mapSnapshot(const char *path);
+void loadSnapshot(macrolist_t *macros, image_t *image);
+image_t *unmapSnapshot(image_t *img);
+image_t *imageMacros(macrolist_t *macros);
+image_t *freeImage(image_t *img);
+int writeImage(int fd, imghead_t *head, image_t *img);
+char *cachePath(const char *dir, const digest_t *hash, const char *suffix);
+int mapRegular(const char *path, char **map, size_t *size, int touch);
+int hashFile(const char *path, digest_t *hash);
+int cacheKey(char **files, int count, digest_t *key);
+dep_t *findDep(deps_t *deps, int kind, const char *name, int len, unsigned int hash);
+unsigned int depHash(void *table, int id);
+void addDep(deps_t *deps, int kind, const char *name, int len, const digest_t *content);
+void depMacro(deps_t *deps, macrolist_t *macros, const char *name, int len, int id);
+void depFile(deps_t *deps, incfile_t *file, const char *name);
+int depHolds(macrolist_t *macros, int kind, const char *name, int len, const digest_t *content);
+int readManifest(macrolist_t *macros, char *map, size_t size, digest_t *hash, uint64_t *bytes);
+int replayCache(proj1_t *ctx, const digest_t *key, proj1_write_t write, void *user);
+deps_t *createDeps(const char *dir, const digest_t *key, proj1_write_t write, void *user);
+int writeIov(int fd, const struct iovec *iov, int count);
+int cacheWrite(void *user, const struct iovec *iov, int count);
+int storeCache(deps_t *deps);
+deps_t *destroyDeps(deps_t *deps);
+int isCacheName(const char *name);
+int compareUsed(const void *a, const void *b);
+void trimCache(const char *dir, long maxBytes);
+int splitSegments(const char *c, int len, int size, segment_t **segments);
+int keepOutput(void *user, const struct iovec *iov, int count);
+void speculate(proj1_t *base, wave_t *wave, segment_t *seg);
+void *speculateWave(void *arg);
+void runWave(wave_t *wave, int threads);
+void redefine(macrolist_t *macros, redef_t *redef);
+int commitSegment(proj1_t *ctx, string_t *doc, segment_t *seg);
+wave_t *destroyWave(wave_t *wave);
+int expandParallel(proj1_t *ctx, proj1_write_t write, void *user);
+void pickScanner(void);
+void enter(proj1_t *ctx, jmp_buf *failed);
+int leave(proj1_t *ctx, int status);
+void closeDocument(document_t *doc);
+int expand(proj1_t *ctx, proj1_write_t write, void *user);
+int fillContext(proj1_t *ctx);
 string_t *destroyString(string_t *str);
 stack_t *destroyStack(stack_t *s);
 macro_t *destroyMacro(macro_t *macro);
 macrolist_t *destroyMacros(macrolist_t *macros);
 
+// What WARN says: kept for proj1Error, and passed on to the context's
+// report callback
+void report(const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(current->error, ERROR_MAX, format, args);
+	va_end(args);
+
+	// Kept output would not warn again
+	if (current->doc.deps)
+		current->doc.deps->warned = 1;
+
+	if (current->report)
+		current->report(current->reportUser, current->error);
+}
+
+// Back to the entry point of the call, which returns status
+void fail(int status)
+{
+	longjmp(*failJump, status);
+}
+
+void *arenaAlloc(arena_t *arena, size_t size)
+{
+	block_t *block = arena->current, *next;
+	size_t blockSize;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+	if (!block || block->used + size > block->size)
+	{
+		// Reuse the next block (one released earlier) if it will do
+		next = block ? block->next : arena->first;
+
+		if (next && size <= next->size)
+			block = next;
+		else
+		{
+			blockSize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+			if (!(next = malloc(BLOCK_HEADER + blockSize)))
+				DIE("%s", "Bad memory arenaAlloc\n");
+
+			next->size = blockSize;
+
+			if (block)
+			{
+				next->next = block->next;
+				block->next = next;
+			}
+			else
+			{
+				next->next = arena->first;
+				arena->first = next;
+			}
+
+			block = next;
+		}
+
+		block->used = 0;
+		arena->current = block;
+	}
+
+	block->used += size;
+
+	return (char *) block + BLOCK_HEADER + block->used - size;
+}
+
+mark_t arenaMark(arena_t *arena)
+{
+	mark_t mark;
+
+	mark.block = arena->current;
+	mark.used = mark.block ? mark.block->used : 0;
+
+	return mark;
+}
+
+// Give back everything allocated since mark was taken, in O(1)
+void arenaRelease(arena_t *arena, mark_t mark)
+{
+	arena->current = mark.block;
+
+	if (mark.block)
+		mark.block->used = mark.used;
+}
+
+void destroyArena(arena_t *arena)
+{
+	block_t *block, *next;
+
+	for (block = arena->first; block; block = next)
+	{
+		next = block->next;
+		free(block);
+	}
+
+	arena->first = arena->current = NULL;
+}
+
+void *poolAlloc(pool_t *pool)
+{
+	void *obj;
+
+#ifdef NO_POOLS
+	if (!(obj = malloc(pool->size)))
+		DIE("%s", "Bad memory poolAlloc\n");
+#else
+	if ((obj = pool->free))
+		pool->free = *(void **) obj;
+	else obj = arenaAlloc(&pool->arena, pool->size);
+#endif
+
+	return obj;
+}
+
+void poolFree(pool_t *pool, void *obj)
+{
+#ifdef NO_POOLS
+	(void) pool;
+	free(obj);
+#else
+	*(void **) obj = pool->free;
+	pool->free = obj;
+#endif
+}
+
 string_t *destroyString(string_t *str)
 {
 	if (!str)
 		return NULL;
-		
-	free(str->charAt);
-	free(str);
+
+	// Still referenced by some chunk
+	if (str->refs > 0)
+	{
+		str->refs--;
+		return NULL;
+	}
+
+	if (str->storage == STORE_MAP)
+		munmap(str->charAt, str->length);
+
+	else if (str->storage == STORE_HEAP)
+		free(str->charAt);
+
+	free(str->braces);
+	poolFree(&stringPool, str);
 
 	return NULL;
 }
@@ -114,9 +1074,9 @@ stack_t *destroyStack(stack_t *stack)
 	for (stackNode = stack->head; stackNode != NULL; stackNode = next)
 	{
 		next = stackNode->next;
-		free(stackNode->data);
-		free(stackNode);
+		destroyNode(stackNode);
 	}
+	releaseFrame(stack->frame);
 	free(stack);
 
 	return NULL;
@@ -127,10 +1087,8 @@ macro_t *destroyMacro(macro_t *macro)
 	if (!macro)
 		return NULL;
 		
-	free(macro->name);
-	free(macro->value);
-
-	free(macro);
+	// The rest is in the macro list's arena
+	destroyTemplate(macro->body);
 
 	return NULL;
 }
@@ -142,1068 +1100,5411 @@ macrolist_t *destroyMacros(macrolist_t *macros)
 	if (!macros)
 		return NULL;
 		
-	for (i = 0; i < macros->capacity; i++)
+	for (i = 0; i < macros->index; i++)
 		destroyMacro(macros->arr[i]);
-		
+
+	destroyMemo(macros->memo);
+	destroyArena(&macros->arena);
 	free(macros->arr);
+	free(macros->slots);
 	free(macros);
-		
+
 	return NULL;
 }
 
-macro_t *createMacro(char *name, char *value)
+macro_t *createMacro(macrolist_t *macros, char *name)
 {
-	macro_t *macro = malloc(sizeof(macro_t));
+	macro_t *macro = arenaAlloc(&macros->arena, sizeof(macro_t));
 	macro->name = name;
-	macro->value = value;
+	macro->body = NULL;
+	macro->nameLen = strlen(name);
+	macro->hash = hashName(name, macro->nameLen);
+	macro->defined = 0;
 
 	return macro;
 }
 
 macrolist_t *initMacros(void)
 {
-	macrolist_t *macros = malloc(sizeof(macrolist_t));
-	macro_t **initialMacros	 = calloc(INIT_MACRO_CAPACITY, sizeof(macro_t));
-	initialMacros[DEF]			= createMacro(strdup("def"), NULL);
-	initialMacros[UNDEF]		= createMacro(strdup("undef"), NULL);
-	initialMacros[IFDEF]		= createMacro(strdup("ifdef"), NULL);
-	initialMacros[IF]			 = createMacro(strdup("if"), NULL);
-	initialMacros[INCLUDE]		= createMacro(strdup("include"), NULL);
-	initialMacros[EXPANDAFTER]	= createMacro(strdup("expandafter"), NULL); 
-		
-	macros->arr = initialMacros;
-	macros->size = macros->index = 6;
+	macrolist_t *macros = calloc(1, sizeof(macrolist_t));
+	int i;
+
+	macros->arr = calloc(INIT_MACRO_CAPACITY, sizeof(macro_t *));
 	macros->capacity = INIT_MACRO_CAPACITY;
+	macros->slots = malloc(INIT_TABLE_SIZE * sizeof(int));
+	macros->tableSize = INIT_TABLE_SIZE;
+
+	for (i = 0; i < macros->tableSize; i++)
+		macros->slots[i] = EMPTY_SLOT;
+
+	// Interned first, so the built-ins keep their fixed ids
+	internMacro(macros, "def", 3);
+	internMacro(macros, "undef", 5);
+	internMacro(macros, "ifdef", 5);
+	internMacro(macros, "if", 2);
+	internMacro(macros, "include", 7);
+	internMacro(macros, "expandafter", 11);
+
+	for (i = 0; i < PROTECTED_MACROS; i++)
+		macros->arr[i]->defined = 1;
+
+	macros->size = PROTECTED_MACROS;
 
 	return macros;
 }
 
 string_t *createString(char *str)
 {
-	string_t *newStr = calloc(1, sizeof(string_t));
-	if (!str || !newStr)
+	string_t *newStr;
+
+	if (!str)
 		return NULL;
 
-	newStr->length = strlen(str);
-	newStr->charAt = strdup(str);
+	newStr = newString(strlen(str));
+	memcpy(newStr->charAt, str, newStr->length + 1);
 
 	return newStr;
 }
 
-int findMacro(char *str, macrolist_t *macros)
+// A buffer with room for len characters and a NUL. Short ones are
+// kept in the pool with the header.
+string_t *newString(int len)
 {
-	int len, index = -1, i, start, end;
-	macro_t *macro;
-	char *tmp;
-
-	if (!str || !macros || !(len = strlen(str)))
-		return -1;
-		
-	tmp = calloc(len + 1, sizeof(char));
-
-	start = str[0] == BRACE_OPEN || str[0] == ESCAPE ? 1 : 0;
-	end = str[len - 1] == BRACE_CLOSE && str[0] != ESCAPE ? len - 1 : len;
+	string_t *newStr = poolAlloc(&stringPool);
 
-	for (i = 0; i < end - start; i++)
-		tmp[i] = str[i + start];
+	newStr->length = len;
+	newStr->refs = 0;
+	newStr->braces = NULL;
 
-	for (i = 0; i < macros->capacity && index == -1; i++)
+	if (len < SMALL_STRING)
 	{
-		macro = macros->arr[i];
-		if (macro)
-		{
-			if (macros->arr[i] && !strcmp(tmp, macros->arr[i]->name))
-				index = i;
-		}
+		newStr->charAt = (char *) (newStr + 1);
+		newStr->storage = STORE_POOL;
 	}
+	else if ((newStr->charAt = malloc(len + 1)))
+		newStr->storage = STORE_HEAP;
+	else DIE("%s", "Bad memory newString\n");
 
-	free(tmp);
-
-	return index;
-}
+	newStr->charAt[len] = '\0';
 
-int isValidDefArg(char *str)
-{ 
-	return str && strlen(str) > 2 && isValidArg(str); 
+	return newStr;
 }
 
-int isValidArg(char *str)
+// Wrap an allocated buffer (NUL terminated at len) without copying it
+string_t *takeString(char *str, int len)
 {
-	int len, braces, i;
-	if (!str || str[0] != BRACE_OPEN || (len = strlen(str)) < 2 || str[len - 1] != BRACE_CLOSE)
-		return 0;
+	string_t *newStr;
 
-	braces = 0;
-	len--;
+	if (!str)
+		DIE("%s", "Bad memory takeString\n");
 
-	for (i = 1; i < len; i++)
-	{
-		if (str[i] == BRACE_OPEN && str[i - 1] != ESCAPE)
-			braces++;
-		else if (str[i] == BRACE_CLOSE && str[i - 1] != ESCAPE)
-			braces--;
-		
-		if (braces < 0)
-			return 0;
-	}
-		
-	return braces == 0;
+	newStr = poolAlloc(&stringPool);
+	newStr->length = len;
+	newStr->charAt = str;
+	newStr->refs = 0;
+	newStr->storage = STORE_HEAP;
+	newStr->braces = NULL;
+
+	return newStr;
 }
 
-int argIsAlnum(char *str)
+string_t *retainString(string_t *str)
 {
-	int len = strlen(str) - 1, i;
+	if (str)
+		str->refs++;
 
-	for (i = 1; i < len; i++)
-		if (!isalnum(str[i]))
-			return 0;
-		
-	return 1;
+	return str;
 }
 
-node_t *createNode(char *data, node_t *next)
+// FNV-1a
+unsigned int hashName(const char *name, int len)
 {
-	node_t *node;
-	char *str;
-	int i, len = strlen(data);
-
-	if (!(node = malloc(sizeof(node_t))) ||
-		!(str = calloc(len + 1, sizeof(char))))
-		DIE("%s", "Bad memory createNode\n");
+	unsigned int hash = 2166136261u;
+	int i;
 
 	for (i = 0; i < len; i++)
-		str[i] = data[i];
-
-	node->data = str;
-	node->next = next;
-
-	return node;
-}
+	{
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
 
-stack_t *createStack()
-{
-	return calloc(1, sizeof(stack_t));
+	return hash;
 }
 
-void push(stack_t *s, char *data)
+// Enter id in the slots of an open addressing table (linear probing)
+// that holds ids 0 to id - 1 so far, keeping the load factor under 1/2:
+// past it the slots double and the ids go back in by the hash hashOf
+// gives (each entry keeps its own)
+void putSlot(int **slots, int *size, int id, unsigned int hash, unsigned int (*hashOf)(void *table, int id), void *table)
 {
-	if (!s || !data || !data[0])
-		return;
-		
-	node_t *node;
+	int mask, i, old, *newSlots;
 
-	if (node = createNode(data, s->head))
-	{
-		s->head = node;
-		s->size++;
-	}
-	else
+	if (2 * (id + 1) > *size)
 	{
-		DIE("%s", "Bad memory push\n");
-	}
-}
+		mask = (*size ? 2 * *size : INIT_TABLE_SIZE) - 1;
 
+		if (!(newSlots = malloc((mask + 1) * sizeof(int))))
+			DIE("%s", "Bad memory putSlot\n");
 
-void pushString(stack_t *s, char *str, int from, int commentStart, int commentEnd, int len)
-{
-	if (!s || !str || from < 0)
-		return;
-
-	char *data = calloc(len + 1, sizeof(char));
-	int i, j;
+		for (i = 0; i <= mask; i++)
+			newSlots[i] = EMPTY_SLOT;
 
-	if (commentStart != commentEnd)
-	{
-		for (i = 0; i + from < commentStart && str[i + from]; i++)
+		for (old = 0; old < id; old++)
 		{
-			data[i] = str[i + from];
-			len--;
+			for (i = hashOf(table, old) & mask; newSlots[i] != EMPTY_SLOT; i = (i + 1) & mask)
+				;
+			newSlots[i] = old;
 		}
 
-		for (j = 0; len-- && str[j + commentEnd]; j++)
-			data[i++] = str[j + commentEnd];
-
+		free(*slots);
+		*slots = newSlots;
+		*size = mask + 1;
 	}
-	else for (i = from; i < from + len && str[from]; i++)
-		data[i - from] = str[i];
 
-	push(s, data);
-	free(data);
+	mask = *size - 1;
+	for (i = hash & mask; (*slots)[i] != EMPTY_SLOT; i = (i + 1) & mask)
+		;
+	(*slots)[i] = id;
 }
 
-char *pop(stack_t *s)
+// A table that starts out as base, for proj1Clone. Names (ids and hash
+// slots) are copied, definitions are shared until undefined. base must
+// outlive it: the names stay in base's arena.
+macrolist_t *cloneMacros(macrolist_t *base)
 {
-	node_t *node;
-	char *popped;
+	macrolist_t *macros = calloc(1, sizeof(macrolist_t));
+	macro_t *macro;
+	int i;
 
-	if (!s || !(node = s->head))
-		return NULL;
+	if (!macros || !(macros->arr = malloc(base->capacity * sizeof(macro_t *))) ||
+		!(macros->slots = malloc(base->tableSize * sizeof(int))))
+		DIE("%s", "Bad memory cloneMacros\n");
 
-	popped = strdup(node->data);
-	free(node->data);
-	s->head = node->next;
-	s->size--;
-	free(node);
+	memcpy(macros->slots, base->slots, base->tableSize * sizeof(int));
+	macros->tableSize = base->tableSize;
+	macros->capacity = base->capacity;
+	macros->index = base->index;
+	macros->size = base->size;
+
+	for (i = 0; i < base->index; i++)
+	{
+		macro = arenaAlloc(&macros->arena, sizeof(macro_t));
+		*macro = *base->arr[i];
+		macro->body = retainTemplate(macro->body);
+		macros->arr[i] = macro;
+	}
 
-	return popped;
+	return macros;
 }
 
-void flipStack(stack_t *s1, stack_t *s2)
+// Id of an interned name (defined or not), NOT_FOUND if never seen
+int lookupMacro(macrolist_t *macros, const char *name, int len)
 {
-	char *str;
-	while (s1->head)
+	unsigned int hash = hashName(name, len);
+	int mask = macros->tableSize - 1, i, id;
+	macro_t *macro;
+
+	for (i = hash & mask; (id = macros->slots[i]) != EMPTY_SLOT; i = (i + 1) & mask)
 	{
-		str = pop(s1);
-		push(s2, str);
-		free(str);
+		macro = macros->arr[id];
+		if (macro->hash == hash && macro->nameLen == len && !memcmp(macro->name, name, len))
+			return id;
 	}
+
+	return NOT_FOUND;
 }
 
-int getStackTotalLength(stack_t *s)
+unsigned int macroHash(void *table, int id)
 {
-	int len = 0;
-	for (node_t *tmp = s->head; tmp; tmp = tmp->next)
-		len += strlen(tmp->data);
-		
-	return len;
+	return ((macrolist_t *) table)->arr[id]->hash;
 }
 
-string_t *stackToString(stack_t *s)
+int internMacro(macrolist_t *macros, const char *name, int len)
 {
-	string_t *str;
-	char *tempString;
-	node_t *tmp;
-	int i = 0, j;
+	int id;
+	char *copy;
 
-	if (!s || !s->size)
-		return NULL;
-		
-	str = malloc(sizeof(string_t));
-	str->length = getStackTotalLength(s);
-	str->charAt = calloc(str->length + 1, sizeof(char));
+	if ((id = lookupMacro(macros, name, len)) != NOT_FOUND)
+		return id;
 
-	for (tmp = s->head; tmp; tmp = tmp->next)
+	// Expand (double size)
+	if (macros->index == macros->capacity)
 	{
-		tempString = tmp->data;
-		
-		for (j = 0; tempString[j]; j++)
-			str->charAt[i++] = tempString[j];
-
+		macros->capacity *= 2;
+		if (!(macros->arr = realloc(macros->arr, macros->capacity * sizeof(macro_t *))))
+			DIE("%s", "Bad memory internMacro\n");
 	}
 
-	return str;
-}
+	copy = arenaAlloc(&macros->arena, len + 1);
+	memcpy(copy, name, len);
+	copy[len] = '\0';
 
-int isSpecialCharacter(char c)
-{
-	switch(c)
-	{
-		case ESCAPE:
-		case ARGUMENT:
-		case BRACE_OPEN:
-		case BRACE_CLOSE:
-		case COMMENT_START:
-			return 1;
-		default: return 0;	
-	}
+	id = macros->index;
+	macros->arr[id] = createMacro(macros, copy);
+	putSlot(&macros->slots, &macros->tableSize, id, macros->arr[id]->hash, macroHash, macros);
+	macros->index++;
+
+	return id;
 }
 
-int isPreservedCharacter(char c)
+int findMacro(char *str, int len, macrolist_t *macros)
 {
-	switch(c)
-	{
-		case '[':
-		case ']':
-		case '(':
-		case ')':
-		case '+':
-		case '-':
-		case '*':
-		case '/':
-		case '=':
-			return 1;
-		default: return 0;	
+	int index, start, end;
+
+	if (!str || !macros || len <= 0)
+		return -1;
+
+	start = str[0] == BRACE_OPEN || str[0] == ESCAPE ? 1 : 0;
+	end = str[len - 1] == BRACE_CLOSE && str[0] != ESCAPE ? len - 1 : len;
+
+	if (end < start)
+		return -1;
+
+	index = lookupMacro(macros, str + start, end - start);
+
+	// The built-ins are the same for every document
+	if (current->doc.deps && (index == NOT_FOUND || index >= PROTECTED_MACROS))
+		depMacro(current->doc.deps, macros, str + start, end - start, index);
+
+	if (index == NOT_FOUND || !macros->arr[index]->defined)
+		return -1;
+
+	return index;
+}
+
+int isValidDefArg(node_t *node)
+{ 
+	return node && node->len > 2 && isValidArg(node); 
+}
+
+// A whole group, counting the braces between the outer two that do not
+// follow an ESCAPE. The lexer matches braces the same way but for one
+// after an escaped ESCAPE (\\{), so the chunks it cut out without one
+// are known to be whole, only the others are gone over.
+int isValidArg(node_t *node)
+{
+	int braces = 0, i;
+
+	if (!node || node->kind != TOKEN_GROUP || node->data[node->len - 1] != BRACE_CLOSE)
+		return 0;
+
+	if (node->flags & TOKEN_BALANCED)
+		return 1;
+
+	for (i = 1; i < node->len - 1; i++)
+	{
+		if (node->data[i] == BRACE_OPEN && node->data[i - 1] != ESCAPE)
+			braces++;
+		else if (node->data[i] == BRACE_CLOSE && node->data[i - 1] != ESCAPE)
+			braces--;
+
+		if (braces < 0)
+			return 0;
+	}
+
+	return !braces;
+}
+
+int argIsAlnum(char *str, int len)
+{
+	int i;
+
+	for (i = 1; i < len - 1; i++)
+		if (!isalnum(str[i]))
+			return 0;
+		
+	return 1;
+}
+
+// Chunks are told apart by their first characters once, when they are
+// made
+int tokenKind(char *data, int len)
+{
+	if (len == 1)
+		return data[0] == ESCAPE ? TOKEN_ESCAPE : data[0] == NEW_LINE ? TOKEN_NEWLINE : TOKEN_TEXT;
+
+	if (len < 1)
+		return TOKEN_TEXT;
+
+	if (data[0] == ESCAPE)
+		return isSpecialCharacter(data[1]) || isPreservedCharacter(data[1]) ? TOKEN_ESCAPED : TOKEN_WORD;
+
+	return data[0] == BRACE_OPEN ? TOKEN_GROUP : TOKEN_TEXT;
+}
+
+node_t *createNode(string_t *buf, char *data, int len, node_t *next)
+{
+	node_t *node = poolAlloc(&nodePool);
+
+	node->data = data;
+	node->len = len;
+	node->kind = tokenKind(data, len);
+	node->flags = 0;
+	node->buf = retainString(buf);
+	node->next = next;
+	node->frame = NULL;
+
+	return node;
+}
+
+node_t *destroyNode(node_t *node)
+{
+	if (!node)
+		return NULL;
+
+	destroyString(node->buf);
+	if (node->frame)
+		releaseFrame(node->frame);
+	poolFree(&nodePool, node);
+
+	return NULL;
+}
+
+// Append copies of the list chunks to the list ending at *tail, returns
+// how many there were. The copies share the text.
+int copyChunks(node_t *chunks, node_t ***tail)
+{
+	int count = 0;
+
+	for (; chunks; chunks = chunks->next, count++)
+	{
+		**tail = createNode(chunks->buf, chunks->data, chunks->len, NULL);
+		(**tail)->flags = chunks->flags;
+		*tail = &(**tail)->next;
+	}
+
+	if (stats.enabled)
+		stats.chunksReplayed += count;
+
+	return count;
+}
+
+long chunkBytes(node_t *chunks)
+{
+	long bytes = 0;
+
+	for (; chunks; chunks = chunks->next)
+		bytes += chunks->len;
+
+	return bytes;
+}
+
+void destroyChunks(node_t *chunks)
+{
+	node_t *next;
+
+	for (; chunks; chunks = next)
+	{
+		next = chunks->next;
+		destroyNode(chunks);
+	}
+}
+
+stack_t *createStack()
+{
+	return calloc(1, sizeof(stack_t));
+}
+
+void pushNode(stack_t *s, node_t *node)
+{
+	if (!s || !node)
+		return;
+
+	node->next = s->head;
+	s->head = node;
+	s->size++;
+	s->bytes += node->len;
+}
+
+void push(stack_t *s, string_t *buf, char *data, int len)
+{
+	if (!s || !data || len <= 0)
+		return;
+
+	pushNode(s, createNode(buf, data, len, NULL));
+
+	if (s->frame)
+		s->head->frame = retainFrame(s->frame);
+}
+
+// Put the list first (count chunks, up to tail) in front of s. With
+// frames on, the chunks are marked as coming from the current step.
+void spliceChunks(stack_t *s, node_t *first, node_t **tail, int count)
+{
+	node_t *node;
+
+	if (!first)
+		return;
+
+	if (s->frame)
+		for (node = first; node; node = node->next)
+		{
+			node->frame = retainFrame(s->frame);
+			s->bytes += node->len;
+		}
+	else for (node = first; node; node = node->next)
+		s->bytes += node->len;
+
+	*tail = s->head;
+	s->head = first;
+	s->size += count;
+}
+
+// Detach the top chunk (the caller owns it)
+node_t *pop(stack_t *s)
+{
+	node_t *node;
+
+	if (!s || !(node = s->head))
+		return NULL;
+
+	s->head = node->next;
+	s->size--;
+	s->bytes -= node->len;
+	node->next = NULL;
+
+	return node;
+}
+
+int isSpecialCharacter(char c)
+{
+	return (charClass[(unsigned char) c] & CLASS_SPECIAL) != 0;
+}
+
+int isPreservedCharacter(char c)
+{
+	return (charClass[(unsigned char) c] & CLASS_PRESERVED) != 0;
+}
+
+// Drops each ESCAPE followed by a character not in the classes keep,
+// copying the text in between a run at a time. Escaping never makes
+// text longer: dst needs room for len characters (and a NUL), and may
+// be str itself. Returns the escaped length.
+int unescape(char *dst, char *str, int len, int keep)
+{
+	char *end = str + len, *at;
+	int j = 0;
+
+	while ((at = memchr(str, ESCAPE, end - str)))
+	{
+		memmove(dst + j, str, at - str);
+		j += at - str;
+
+		if (at + 1 < end && !(charClass[(unsigned char) at[1]] & keep))
+		{
+			dst[j++] = at[1];
+			str = at + 2;
+		}
+		else
+		{
+			dst[j++] = ESCAPE;
+			str = at + 1;
+		}
+	}
+
+	memmove(dst + j, str, end - str);
+	j += end - str;
+	dst[j] = '\0';
+
+	return j;
+}
+
+// What an escaped character chunk comes to
+int esc(char *dst, char *str, int len)
+{
+	return unescape(dst, str, len, CLASS_SPECIAL | CLASS_PRESERVED);
+}
+
+// What the output comes to
+int escAll(char *dst, char *str, int len)
+{
+	return unescape(dst, str, len, CLASS_PRESERVED);
+}
+
+// escAll(esc(str)), in one pass
+int escBoth(char *dst, char *str, int len)
+{
+	char *end = str + len, *at;
+	int j = 0, both = CLASS_SPECIAL | CLASS_PRESERVED;
+
+	while ((at = memchr(str, ESCAPE, end - str)))
+	{
+		memmove(dst + j, str, at - str);
+		j += at - str;
+		str = at + 2;
+
+		if (at + 1 == end)
+		{
+			dst[j++] = ESCAPE;
+			str = end;
+		}
+		else if (at[1] != ESCAPE)
+		{
+			// esc() keeps the ESCAPE only for a special or preserved
+			// character, and escAll() only for a preserved one
+			if (charClass[(unsigned char) at[1]] & CLASS_PRESERVED)
+				dst[j++] = ESCAPE;
+
+			dst[j++] = at[1];
+		}
+		else if (at + 2 < end && !(charClass[(unsigned char) at[2]] & both))
+		{
+			// esc() keeps the first ESCAPE and drops the second, so
+			// escAll() drops the first
+			dst[j++] = at[2];
+			str = at + 3;
+		}
+		else dst[j++] = ESCAPE;
+	}
+
+	memmove(dst + j, str, end - str);
+	j += end - str;
+	dst[j] = '\0';
+
+	return j;
+}
+
+// End of str's contents once its braces are removed (they start at
+// str[0] == BRACE_OPEN). Mirrors what removeBraces copies.
+int bracesEnd(char *str, int len)
+{
+	int last = str[0] == BRACE_OPEN;
+
+	if (len - 1 > last)
+		last = len - 1;
+
+	if (last < len && str[last] != BRACE_CLOSE)
+		return len;
+
+	return last;
+}
+
+// The copy comes from arena, or the heap if it is NULL
+char *removeBraces(char *str, int len, arena_t *arena)
+{
+	char *newStr;
+	int start, end;
+
+	if (!str || len <= 0)
+		return NULL;
+
+	start = (str[0] == BRACE_OPEN);
+	end = bracesEnd(str, len);
+
+	if (end < start)
+		end = start;
+
+	newStr = arena ? arenaAlloc(arena, end - start + 1) : malloc(end - start + 1);
+	if (!newStr)
+		DIE("%s", "Bad memory removeBraces\n");
+
+	memcpy(newStr, str + start, end - start);
+	newStr[end - start] = '\0';
+
+	return newStr;
+}
+
+void def(macrolist_t *macros, char *name, int nameLen, char *value, int valueLen)
+{
+	mark_t mark = arenaMark(&scratch);
+	char *newName = removeBraces(name, nameLen, &scratch);
+	int id = internMacro(macros, newName, strlen(newName));
+	macro_t *macro = macros->arr[id];
+
+	arenaRelease(&scratch, mark);
+
+	macro->body = compileTemplate(removeBraces(value, valueLen, NULL));
+	macro->defined = 1;
+	macros->size++;
+	macros->generation++;
+}
+
+void undef(macrolist_t *macros, int index)
+{
+	if (!macros || index < 0 || index >= macros->index || !macros->arr[index]->defined)
+		return;
+
+	macros->arr[index]->body = destroyTemplate(macros->arr[index]->body);
+	macros->arr[index]->defined = 0;
+	macros->size--;
+	macros->generation++;
+}
+
+// Takes ownership of value
+template_t *compileTemplate(char *value)
+{
+	template_t *tpl = calloc(1, sizeof(template_t));
+	tpart_t *part;
+	node_t **tail;
+	char *c;
+	int *resets, resetCount = 0, depth = 0, len, i, k, r, next;
+	mark_t mark;
+
+	if (!tpl)
+		DIE("%s", "Bad memory compileTemplate\n");
+
+	tpl->text = takeString(value, strlen(value));
+	c = value;
+	len = tpl->text->length;
+
+	mark = arenaMark(&scratch);
+	resets = arenaAlloc(&scratch, (len + 1) * sizeof(int));
+
+	if (!(tpl->slots = malloc((len + 1) * sizeof(int))))
+		DIE("%s", "Bad memory compileTemplate\n");
+
+	// Escaped pairs never hold a slot
+	for (i = 0; i < len; i++)
+	{
+		if (c[i] == ESCAPE)
+			i++;
+		else if (c[i] == ARGUMENT)
+			tpl->slots[tpl->slotCount++] = i;
+	}
+
+	tail = &tpl->chunks;
+
+	if (!tpl->slotCount)
+	{
+		lexChunks(tpl->text, 0, len, NULL, &tail);
+		arenaRelease(&scratch, mark);
+
+		return tpl;
+	}
+
+	// Where chunking is likely to start over whatever the arguments
+	// are (as long as their braces match up). Only a guess: a call
+	// checks that chunking really did start over there.
+	for (i = 0; i < len; i++)
+	{
+		switch (c[i])
+		{
+			case ESCAPE:
+				if (isSpecialCharacter(c[i + 1]))
+					i++;
+				break;
+
+			case COMMENT_START:
+				while (i < len && c[i] != NEW_LINE)
+					i++;
+				break;
+
+			case BRACE_OPEN:
+				depth++;
+				break;
+
+			case BRACE_CLOSE:
+				if (depth > 0 && !--depth)
+					resets[resetCount++] = i + 1;
+				break;
+
+			case NEW_LINE:
+				if (!depth)
+					resets[resetCount++] = i + 1;
+				break;
+		}
+	}
+
+	if (!(tpl->parts = malloc(tpl->slotCount * sizeof(tpart_t))))
+		DIE("%s", "Bad memory compileTemplate\n");
+
+	// The body up to the first slot never sees an argument
+	part = tpl->parts;
+	lexChunks(tpl->text, 0, tpl->slots[0], &part->from, &tail);
+	part->fromSlots = 0;
+
+	for (k = r = 0; ; )
+	{
+		// The part has to reach past slot k, and past any slot before
+		// the point it ends at
+		for (; r < resetCount && resets[r] <= tpl->slots[k]; r++)
+			;
+
+		for (; k + 1 < tpl->slotCount && r < resetCount && resets[r] > tpl->slots[k + 1]; k++)
+			for (; r < resetCount && resets[r] <= tpl->slots[k + 1]; r++)
+				;
+
+		part->chunks = NULL;
+		tail = &part->chunks;
+		tpl->partCount++;
+
+		if (r == resetCount)
+		{
+			part->to = -1;
+			part->toSlots = tpl->slotCount;
+			break;
+		}
+
+		part->to = resets[r];
+		part->toSlots = ++k;
+
+		if (k == tpl->slotCount)
+		{
+			lexChunks(tpl->text, part->to, len, NULL, &tail);
+			break;
+		}
+
+		next = part->to;
+		lexChunks(tpl->text, part->to, tpl->slots[k], &next, &tail);
+
+		part++;
+		part->from = next;
+		part->fromSlots = k;
+	}
+
+	arenaRelease(&scratch, mark);
+
+	return tpl;
+}
+
+template_t *retainTemplate(template_t *tpl)
+{
+	if (tpl)
+		tpl->refs++;
+
+	return tpl;
+}
+
+template_t *destroyTemplate(template_t *tpl)
+{
+	int i;
+
+	if (!tpl)
+		return NULL;
+
+	if (tpl->refs)
+	{
+		tpl->refs--;
+		return NULL;
+	}
+
+	destroyChunks(tpl->chunks);
+
+	for (i = 0; i < tpl->partCount; i++)
+		destroyChunks(tpl->parts[i].chunks);
+
+	destroyString(tpl->text);
+	free(tpl->slots);
+	free(tpl->parts);
+	free(tpl);
+
+	return NULL;
+}
+
+// Push the body of tpl with arg (argLen long) in its slots onto s
+void expandTemplate(template_t *tpl, char *arg, int argLen, stack_t *s)
+{
+	node_t *first = NULL, **tail = &first;
+	string_t *str;
+	tpart_t *part;
+	char *c = tpl->text->charAt, *data;
+	int count, len, i, from, to, safe;
+
+	count = copyChunks(tpl->chunks, &tail);
+
+	if (tpl->slotCount)
+	{
+		len = tpl->text->length + tpl->slotCount * (argLen - 1);
+		str = newString(len);
+		data = str->charAt;
+
+		for (i = from = to = 0; i <= tpl->slotCount; i++)
+		{
+			safe = i < tpl->slotCount ? tpl->slots[i] : tpl->text->length;
+			memcpy(data + to, c + from, safe - from);
+			to += safe - from;
+
+			if (i < tpl->slotCount)
+			{
+				memcpy(data + to, arg, argLen);
+				to += argLen;
+				from = safe + 1;
+			}
+		}
+
+		for (part = tpl->parts; part < tpl->parts + tpl->partCount; part++)
+		{
+			from = part->from + part->fromSlots * (argLen - 1);
+
+			if (part->to < 0)
+			{
+				count += lexChunks(str, from, len, NULL, &tail);
+				break;
+			}
+
+			to = part->to + part->toSlots * (argLen - 1);
+			count += lexChunks(str, from, to, &safe, &tail);
+
+			// The argument left chunking somewhere else than
+			// expected, carry on the slow way
+			if (safe != to)
+			{
+				count += lexChunks(str, safe, len, NULL, &tail);
+				break;
+			}
+
+			count += copyChunks(part->chunks, &tail);
+		}
+
+		destroyString(str);
+	}
+
+	spliceChunks(s, first, tail, count);
+}
+
+string_t *argContents(node_t *node, int *start, int *end)
+{
+	*start = node->data - node->buf->charAt + 1;
+	*end = *start + node->len - 2;
+
+	return retainString(node->buf);
+}
+
+// Chunk the contents of a group (or if/ifdef branch) in place,
+// straight out of the buffer it already lives in
+void chunkContents(node_t *node, stack_t *s)
+{
+	string_t *buf = retainString(node->buf);
+	int start = node->data - buf->charAt;
+	int end = start + bracesEnd(node->data, node->len);
+
+	chunkRange(buf, start + 1, end < start + 1 ? start + 1 : end, s);
+	destroyString(buf);
+}
+
+// Push the contents of after, then before (the captured output of an
+// \expandafter, most recent first), onto s, chunked as the one string
+// they make. after is chunked where it lies up to the last point
+// chunking starts over from; only the rest of it is copied, with
+// before, and that only when before is not one run of a buffer to be
+// chunked in place.
+void chunkAfter(node_t *after, stack_t *before, stack_t *s)
+{
+	node_t *first = NULL, **tail = &first, *node;
+	string_t *arg, *str;
+	int start, end, safe, len, count;
+	char *c;
+
+	arg = argContents(after, &start, &end);
+
+	if (!before->head)
+	{
+		spliceChunks(s, first, tail, lexChunks(arg, start, end, NULL, &tail));
+		destroyString(arg);
+		return;
+	}
+
+	count = lexChunks(arg, start, end, &safe, &tail);
+
+	for (node = before->head; node->next; node = node->next)
+		if (!node->buf || node->next->buf != node->buf || node->next->data + node->next->len != node->data)
+			break;
+
+	if (safe == end && !node->next && node->buf)
+	{
+		// One run, chunked from scratch anyway
+		start = node->data - node->buf->charAt;
+		count += lexChunks(node->buf, start, start + before->bytes, NULL, &tail);
+	}
+	else
+	{
+		len = end - safe + before->bytes;
+		str = newString(len);
+		c = str->charAt + len;
+
+		for (node = before->head; node; node = node->next)
+		{
+			c -= node->len;
+			memcpy(c, node->data, node->len);
+		}
+
+		memcpy(str->charAt, arg->charAt + safe, end - safe);
+		count += lexChunks(str, 0, len, NULL, &tail);
+		destroyString(str);
+	}
+
+	destroyString(arg);
+	spliceChunks(s, first, tail, count);
+}
+
+long nowMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+frame_t *retainFrame(frame_t *frame)
+{
+	if (frame)
+		frame->refs++;
+
+	return frame;
+}
+
+frame_t *releaseFrame(frame_t *frame)
+{
+	frame_t *parent;
+
+	// A frame holds on to its parent, let go of the chain iteratively
+	for (; frame && frame->refs-- == 0; frame = parent)
+	{
+		parent = frame->parent;
+		poolFree(&framePool, frame);
+	}
+
+	return NULL;
+}
+
+// Make room for the counters of count macros
+void growStats(int count)
+{
+	int capacity = stats.capacity ? stats.capacity : INIT_MACRO_CAPACITY;
+
+	if (count <= stats.capacity)
+		return;
+
+	while (capacity < count)
+		capacity *= 2;
+
+	if (!(stats.macros = realloc(stats.macros, capacity * sizeof(macrostats_t))))
+		DIE("%s", "Bad memory growStats\n");
+
+	memset(stats.macros + stats.capacity, 0, (capacity - stats.capacity) * sizeof(macrostats_t));
+	stats.capacity = capacity;
+}
+
+// The current step invokes macro: count it, and mark what it pushes as
+// coming from a new frame within the one the invocation came from
+void enterFrame(stack_t *s, int macro)
+{
+	frame_t *frame = poolAlloc(&framePool), *parent = s->frame;
+
+	if (stats.enabled)
+	{
+		growStats(macro + 1);
+		stats.macros[macro].calls++;
+	}
+
+	frame->macro = macro;
+	frame->refs = 0;
+	frame->repeat = 1;
+
+	if (parent && parent->macro == macro)
+	{
+		// Recursion, fold it into the invocation before
+		frame->repeat += parent->repeat;
+		frame->serial = parent->serial;
+		frame->parent = retainFrame(parent->parent);
+		releaseFrame(parent);
+	}
+	else
+	{
+		frame->serial = ++trace.serials;
+		frame->parent = parent;	// takes over the step's reference
+	}
+
+	frame->depth = frame->parent ? frame->parent->depth + 1 : 1;
+	s->frame = frame;
+}
+
+void beginStep(stack_t *s)
+{
+	releaseFrame(s->frame);
+	s->frame = retainFrame(s->head ? s->head->frame : NULL);
+
+	if (trace.emit)
+		closeSpans(s->frame);
+
+	if (stats.enabled)
+	{
+		s->stepStart = nowNs();
+		s->stepNested = stats.attributedNs;
+
+		if (s->size > stats.peakStack)
+			stats.peakStack = s->size;
+	}
+}
+
+// Charge the time of the step to its frame, and to every macro up its
+// chain once
+void endStep(stack_t *s)
+{
+	long ns;
+	frame_t *frame;
+	macrostats_t *m;
+
+	if (!s->stepStart)
+	{
+		s->frame = releaseFrame(s->frame);
+		return;
+	}
+
+	ns = nowNs() - s->stepStart - (stats.attributedNs - s->stepNested);
+	stats.attributedNs += ns;
+	stats.steps++;
+	s->stepStart = 0;
+
+	if (!(frame = s->frame))
+		stats.top.selfNs += ns;
+	else stats.macros[frame->macro].selfNs += ns;
+
+	for (; frame; frame = frame->parent)
+	{
+		m = stats.macros + frame->macro;
+		if (m->stamp != stats.steps)
+		{
+			m->stamp = stats.steps;
+			m->cumulativeNs += ns;
+		}
+	}
+
+	s->frame = releaseFrame(s->frame);
+}
+
+// How many \includes deep frame is
+int includeDepth(frame_t *frame)
+{
+	int depth = 0;
+
+	for (; frame; frame = frame->parent)
+		if (frame->macro == INCLUDE)
+			depth += frame->repeat;
+
+	return depth;
+}
+
+// Called every step (with macro NOT_FOUND) and for every invocation
+void checkLimits(stack_t *s, macrolist_t *macros, int macro)
+{
+	if (limits.timeMs && !(++limits.steps % CLOCK_STEPS) && nowMs() > limits.deadline)
+		dieLimit(s, macros, "time");
+
+	if (limits.stackBytes && s->bytes > limits.stackBytes)
+		dieLimit(s, macros, "pending bytes");
+
+	if (macro == NOT_FOUND)
+		return;
+
+	if (limits.expansions && ++limits.expanded > limits.expansions)
+		dieLimit(s, macros, "expansions");
+
+	if (macro == INCLUDE && limits.includeDepth && includeDepth(s->frame) > limits.includeDepth)
+		dieLimit(s, macros, "include depth");
+}
+
+// Fail naming the chain of invocations the current step came out of,
+// outermost first (only the innermost CHAIN_SHOWN of a long one)
+void dieLimit(stack_t *s, macrolist_t *macros, char *what)
+{
+	frame_t *chain[CHAIN_SHOWN], *frame;
+	char *text, *c;
+	int count = 0, more = 0, len = 32, i;
+
+	for (frame = s->frame; frame; frame = frame->parent)
+	{
+		if (count < CHAIN_SHOWN)
+			chain[count++] = frame;
+		else more++;
+	}
+
+	for (i = 0; i < count; i++)
+		len += macros->arr[chain[i]->macro]->nameLen + 32;
+
+	c = text = arenaAlloc(&scratch, len);
+
+	if (!count)
+		c += sprintf(c, "(top level)");
+	else if (more)
+		c += sprintf(c, "(%d more) > ", more);
+
+	for (i = count - 1; i >= 0; i--)
+	{
+		c += sprintf(c, "\\%s", macros->arr[chain[i]->macro]->name);
+
+		if (chain[i]->repeat > 1)
+			c += sprintf(c, " x%d", chain[i]->repeat);
+
+		if (i)
+			c += sprintf(c, " > ");
+	}
+
+	WARN("%s%s%s%s%s", "Limit on ", what, " reached in ", text, "\n");
+	fail(PROJ1_LIMIT);
+}
+
+// str[0, len) as the inside of a JSON string, into dst (cap bytes at
+// most, an escape is never cut short). Returns its length.
+int jsonString(char *dst, int cap, const char *str, int len)
+{
+	unsigned char c;
+	int n = 0, i;
+
+	for (i = 0; i < len; i++)
+	{
+		c = str[i];
+
+		if (c == '"' || c == ESCAPE)
+		{
+			if (n + 2 > cap)
+				break;
+
+			dst[n++] = ESCAPE;
+			dst[n++] = c;
+		}
+		else if (c < ' ')
+		{
+			if (n + 7 > cap)
+				break;
+
+			n += sprintf(dst + n, "\\u%04x", c);
+		}
+		else if (n < cap)
+			dst[n++] = c;
+		else break;
+	}
+
+	return n;
+}
+
+// Hand the span that ran from start to end (ns) to the trace, as a
+// Chrome trace event with args (members of a JSON object) from format
+void traceSpan(char *cat, char *name, long start, long end, char *format, ...)
+{
+	static int pid;
+	char event[TRACE_EVENT];
+	va_list args;
+	int len;
+
+	if (end - start < trace.minNs)
+		return;
+
+	if (!traceThread)
+	{
+		pthread_mutex_lock(&traceLock);
+		traceThread = ++traceThreads;
+
+		if (!pid)
+			pid = getpid();
+		pthread_mutex_unlock(&traceLock);
+	}
+
+	len = sprintf(event, "{\"name\": \"");
+	len += jsonString(event + len, TRACE_EVENT / 2, name, strlen(name));
+	len += sprintf(event + len, "\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d, \"args\": {",
+		cat, start / 1e3, (end - start) / 1e3, pid, traceThread);
+
+	va_start(args, format);
+	len += vsnprintf(event + len, TRACE_EVENT - len - 2, format, args);
+	va_end(args);
+
+	strcpy(event + len, "}}");
+	trace.emit(trace.user, event);
+}
+
+// The current step has invoked macro (enterFrame made its frame): open
+// a span for it, named after it (\include after its file too)
+void openSpan(stack_t *s, macrolist_t *macros, int macro)
+{
+	frame_t *frame = s->frame;
+	span_t *span = trace.openCount ? trace.open + trace.openCount - 1 : NULL, *spans;
+	node_t *arg = s->head->next;
+	int count = macroArgs(macro), capacity, len;
+
+	// A recursion folded into the invocation before goes on in its span
+	if (span && span->serial == frame->serial)
+	{
+		span->repeat = frame->repeat;
+		return;
+	}
+
+	if (trace.openCount == trace.openCapacity)
+	{
+		capacity = trace.openCapacity ? trace.openCapacity * 2 : INIT_SPANS;
+
+		if (!(spans = realloc(trace.open, capacity * sizeof(span_t))))
+			DIE("%s", "Bad memory openSpan\n");
+
+		trace.open = spans;
+		trace.openCapacity = capacity;
+	}
+
+	span = trace.open + trace.openCount++;
+	span->serial = frame->serial;
+	span->depth = frame->depth;
+	span->macro = macro;
+	span->repeat = frame->repeat;
+	span->start = nowNs();
+	span->argBytes = 0;
+
+	for (; arg && count--; arg = arg->next)
+		span->argBytes += arg->len;
+
+	len = snprintf(span->name, TRACE_NAME, "\\%s", macros->arr[macro]->name);
+
+	if (macro == INCLUDE && s->head->next && len < TRACE_NAME)
+		snprintf(span->name + len, TRACE_NAME - len, "%.*s", s->head->next->len, s->head->next->data);
+}
+
+// The spans of the invocations frame did not come out of (all of them
+// for NULL) are over, innermost first
+void closeSpans(frame_t *frame)
+{
+	span_t *span;
+	long now = 0;
+
+	while (trace.openCount)
+	{
+		span = trace.open + trace.openCount - 1;
+
+		for (; frame && frame->depth > span->depth; frame = frame->parent)
+			;
+
+		if (frame && frame->serial == span->serial)
+			return;
+
+		if (!now)
+			now = nowNs();
+
+		traceSpan(span->macro == INCLUDE ? "include" : "macro", span->name, span->start, now,
+			"\"argBytes\": %d, \"repeat\": %d", span->argBytes, span->repeat);
+		trace.openCount--;
+	}
+}
+
+// An \expandafter's first argument has been expanded (since start) into
+// captured chunks: what it invoked is over too
+void traceNested(stack_t *s, long start, int captured)
+{
+	closeSpans(s->frame);
+	traceSpan("nested", "processChunks", start, nowNs(), "\"captured\": %d", captured);
+}
+
+sink_t *createSink(proj1_write_t write, void *user)
+{
+	sink_t *out = calloc(1, sizeof(sink_t));
+
+	if (!out)
+		DIE("%s", "Bad memory createSink\n");
+
+	out->write = write;
+	out->user = user;
+
+	if (!write)
+		out->chunks = createStack();
+	else if (!(out->buf = malloc(SINK_BUF)))
+		DIE("%s", "Bad memory createSink\n");
+
+	out->lastFlush = nowMs();
+
+	return out;
+}
+
+// Queue len bytes at data (which must stay put until flushed).
+// The caller makes sure there is an iovec to spare.
+void queueOutput(sink_t *out, char *data, int len)
+{
+	struct iovec *last = out->iov + out->iovCount - 1;
+
+	if (out->iovCount && (char *) last->iov_base + last->iov_len == data)
+		last->iov_len += len;
+	else
+	{
+		out->iov[out->iovCount].iov_base = data;
+		out->iov[out->iovCount++].iov_len = len;
+	}
+
+	out->pending += len;
+}
+
+// Copy len bytes at data to the staging buffer and queue them
+void stageOutput(sink_t *out, char *data, int len)
+{
+	if (out->len + len > SINK_BUF || out->iovCount == SINK_IOV)
+		flushSink(out);
+
+	memcpy(out->buf + out->len, data, len);
+	queueOutput(out, out->buf + out->len, len);
+	out->len += len;
+}
+
+// Queue the run gathered so far: in place when it is long enough to
+// be worth an iovec of its own, staged otherwise
+void endRun(sink_t *out)
+{
+	node_t *run = out->run;
+
+	if (!run)
+		return;
+
+	out->run = NULL;
+	out->held = run;
+
+	if (out->runLen >= SINK_DIRECT)
+	{
+		if (out->iovCount == SINK_IOV)
+			flushSink(out);
+
+		queueOutput(out, run->data, out->runLen);
+		run->next = out->pinned;
+		out->pinned = run;
+	}
+	else
+	{
+		stageOutput(out, run->data, out->runLen);
+		destroyNode(run);
+	}
+
+	out->held = NULL;
+}
+
+// Takes ownership of node, returns how many bytes it comes to in the
+// output (none when captured). An escaped character chunk (escaped)
+// goes through esc() first, in the same pass.
+int sinkWrite(sink_t *out, node_t *node, int escaped)
+{
+	char *tmp;
+	int len;
+	mark_t mark;
+	string_t *str;
+	node_t *after;
+
+	if (!node)
+		return 0;
+
+	if (!out->write)
+	{
+		if (escaped)
+		{
+			// Captured text is expanded again, it keeps what esc() made
+			str = newString(node->len);
+			str->length = esc(str->charAt, node->data, node->len);
+			after = createNode(str, str->charAt, str->length, NULL);
+			after->frame = retainFrame(node->frame);
+			pushNode(out->chunks, after);
+			destroyString(str);
+			destroyNode(node);
+			return 0;
+		}
+
+		pushNode(out->chunks, node);
+		return 0;
+	}
+
+	if (escaped || (!(node->flags & TOKEN_UNESCAPED) && memchr(node->data, ESCAPE, node->len)))
+	{
+		endRun(out);
+		out->held = node;
+
+		if (node->len >= SINK_BUF)
+		{
+			// Too long to stage, escape it to scratch space
+			mark = arenaMark(&scratch);
+			tmp = arenaAlloc(&scratch, node->len + 1);
+			len = escaped ? escBoth(tmp, node->data, node->len) : escAll(tmp, node->data, node->len);
+			recordOutput(out, tmp, len);
+
+			flushSink(out);
+			queueOutput(out, tmp, len);
+			flushSink(out);
+			arenaRelease(&scratch, mark);
+		}
+		else
+		{
+			// Escape straight into the staging buffer
+			if (out->len + node->len >= SINK_BUF || out->iovCount == SINK_IOV)
+				flushSink(out);
+
+			tmp = out->buf + out->len;
+			len = escaped ? escBoth(tmp, node->data, node->len) : escAll(tmp, node->data, node->len);
+			recordOutput(out, tmp, len);
+			queueOutput(out, tmp, len);
+			out->len += len;
+		}
+
+		out->held = NULL;
+		destroyNode(node);
+	}
+	else if (out->run && node->buf && node->buf == out->run->buf &&
+		out->run->data + out->runLen == node->data)
+	{
+		// Picks up where the run left off, the run's chunk keeps
+		// the buffer alive for both
+		len = node->len;
+		out->runLen += len;
+		recordOutput(out, node->data, len);
+		destroyNode(node);
+	}
+	else
+	{
+		// Nothing to unescape, start a run from here
+		endRun(out);
+		out->run = node;
+		out->runLen = len = node->len;
+		recordOutput(out, node->data, len);
+	}
+
+	if (out->pending + out->runLen >= SINK_BUF || nowMs() - out->lastFlush >= SINK_FLUSH_MS)
+		flushSink(out);
+
+	return len;
+}
+
+// sinkWrite, counting the time and the bytes for --stats
+void writeChunk(sink_t *out, node_t *node, int escaped)
+{
+	frame_t *frame;
+	long start;
+	int len;
+
+	if (!stats.enabled)
+	{
+		sinkWrite(out, node, escaped);
+		return;
+	}
+
+	frame = retainFrame(node->frame);
+	start = nowNs();
+	len = sinkWrite(out, node, escaped);
+	stats.outputNs += nowNs() - start;
+
+	if (frame)
+		stats.macros[frame->macro].bytes += len;
+	else stats.top.bytes += len;
+
+	releaseFrame(frame);
+}
+
+void flushSink(sink_t *out)
+{
+	node_t *node;
+	long start = 0;
+	int status;
+
+	if (!out->write)
+		return;
+
+	endRun(out);
+
+	if (out->iovCount && !out->broken)
+	{
+		if (trace.emit)
+			start = nowNs();
+
+		status = out->write(out->user, out->iov, out->iovCount);
+
+		if (trace.emit)
+			traceSpan("output", "output", start, nowNs(), "\"bytes\": %ld", out->pending);
+
+		if (status)
+		{
+			out->broken = 1;
+			WARN("%s", "Unable to write output\n");
+			fail(PROJ1_OUTPUT);
+		}
+	}
+
+	while ((node = out->pinned))
+	{
+		out->pinned = node->next;
+		destroyNode(node);
+	}
+
+	out->len = out->iovCount = 0;
+	out->pending = 0;
+	out->lastFlush = nowMs();
+}
+
+sink_t *destroySink(sink_t *out)
+{
+	if (!out)
+		return NULL;
+
+	flushSink(out);
+	destroyStack(out->chunks);
+	destroyStack(out->input);
+	destroyNode(out->after);
+	destroyNode(out->held);
+	free(out->buf);
+	free(out->records);
+	free(out->recorded);
+	free(out);
+
+	return NULL;
+}
+
+memo_t *createMemo(void)
+{
+	memo_t *memo = calloc(1, sizeof(memo_t));
+
+	if (!memo || !(memo->buckets = calloc(INIT_MEMO, sizeof(memoentry_t *))))
+		DIE("%s", "Bad memory createMemo\n");
+
+	memo->bucketCount = INIT_MEMO;
+
+	return memo;
+}
+
+memo_t *destroyMemo(memo_t *memo)
+{
+	if (!memo)
+		return NULL;
+
+	while (memo->oldest)
+		dropMemo(memo, memo->oldest);
+
+	free(memo->buckets);
+	free(memo);
+
+	return NULL;
+}
+
+// A call: its macro and its argument
+unsigned int memoHash(int macro, char *arg, int len)
+{
+	return (hashName(arg, len) ^ macro) * 16777619u;
+}
+
+memoentry_t *findMemo(memo_t *memo, int macro, unsigned int hash, char *arg, int len)
+{
+	memoentry_t *entry = memo->buckets[hash & (memo->bucketCount - 1)];
+
+	for (; entry; entry = entry->chain)
+		if (entry->hash == hash && entry->macro == macro && entry->argLen == len &&
+			!memcmp(entry->text->charAt, arg, len))
+			return entry;
+
+	return NULL;
+}
+
+// Make entry the most recently used
+void linkMemo(memo_t *memo, memoentry_t *entry)
+{
+	entry->newer = NULL;
+	entry->older = memo->newest;
+
+	if (memo->newest)
+		memo->newest->newer = entry;
+	else memo->oldest = entry;
+
+	memo->newest = entry;
+}
+
+void unlinkMemo(memo_t *memo, memoentry_t *entry)
+{
+	if (entry->newer)
+		entry->newer->older = entry->older;
+	else memo->newest = entry->older;
+
+	if (entry->older)
+		entry->older->newer = entry->newer;
+	else memo->oldest = entry->newer;
+}
+
+// Twice the buckets, once there are as many entries as buckets
+void growMemo(memo_t *memo)
+{
+	memoentry_t *entry, **bucket;
+
+	free(memo->buckets);
+	memo->bucketCount *= 2;
+
+	if (!(memo->buckets = calloc(memo->bucketCount, sizeof(memoentry_t *))))
+		DIE("%s", "Bad memory growMemo\n");
+
+	for (entry = memo->newest; entry; entry = entry->older)
+	{
+		bucket = memo->buckets + (entry->hash & (memo->bucketCount - 1));
+		entry->chain = *bucket;
+		*bucket = entry;
+	}
+}
+
+void dropMemo(memo_t *memo, memoentry_t *entry)
+{
+	memoentry_t **at = memo->buckets + (entry->hash & (memo->bucketCount - 1));
+
+	for (; *at != entry; at = &(*at)->chain)
+		;
+
+	*at = entry->chain;
+	unlinkMemo(memo, entry);
+	memo->bytes -= entry->text->length;
+	memo->count--;
+
+	destroyString(entry->text);
+	free(entry);
+}
+
+// Keep what record's call came to: len bytes at data (its argument is
+// its mark's). Entries least recently used make room.
+void storeMemo(memo_t *memo, record_t *record, char *data, int len)
+{
+	node_t *arg = record->mark;
+	memoentry_t *entry, **bucket;
+
+	if ((entry = findMemo(memo, record->macro, record->hash, arg->data, arg->len)))
+		dropMemo(memo, entry);
+
+	while (memo->oldest && memo->bytes + arg->len + len > MEMO_BYTES)
+	{
+		dropMemo(memo, memo->oldest);
+		memo->evictions++;
+	}
+
+	if (memo->count >= memo->bucketCount)
+		growMemo(memo);
+
+	if (!(entry = malloc(sizeof(memoentry_t))))
+		DIE("%s", "Bad memory storeMemo\n");
+
+	entry->hash = record->hash;
+	entry->macro = record->macro;
+	entry->generation = record->generation;
+	entry->document = record->document;
+	entry->argLen = arg->len;
+	entry->text = newString(arg->len + len);
+	memcpy(entry->text->charAt, arg->data, arg->len);
+	memcpy(entry->text->charAt + arg->len, data, len);
+
+	bucket = memo->buckets + (entry->hash & (memo->bucketCount - 1));
+	entry->chain = *bucket;
+	*bucket = entry;
+	linkMemo(memo, entry);
+
+	memo->bytes += entry->text->length;
+	memo->count++;
+}
+
+// A call of macro, with arg (its group) popped. Returns 1 if what it
+// expands to is known (for the table as it is) and has been written.
+// Otherwise a call made before is recorded: its mark goes on s, under
+// where the expansion is about to go.
+int memoCall(stack_t *s, macrolist_t *macros, includes_t *includes, sink_t *out, int macro, node_t *arg)
+{
+	memo_t *memo = macros->memo;
+	memoentry_t *entry;
+	record_t *record;
+	unsigned int hash, key, *seen;
+	node_t *node;
+
+	// Captured output is expanded again, and the limits have to see
+	// every step of an expansion
+	if (!out->write || limits.on)
+		return 0;
+
+	if (!memo)
+		memo = macros->memo = createMemo();
+
+	hash = memoHash(macro, arg->data, arg->len);
+	entry = findMemo(memo, macro, hash, arg->data, arg->len);
+
+	// An expansion recorded before the document being kept for the
+	// output cache would hide the lookups it made
+	if (entry && entry->generation == macros->generation &&
+		(!current->doc.deps || entry->document == macros->documents))
+	{
+		memo->hits++;
+		unlinkMemo(memo, entry);
+		linkMemo(memo, entry);
+
+		if (entry->text->length > entry->argLen)
+		{
+			node = createNode(entry->text, entry->text->charAt + entry->argLen,
+				entry->text->length - entry->argLen, NULL);
+			node->flags = TOKEN_UNESCAPED;
+			node->frame = retainFrame(s->frame);
+			writeChunk(out, node, 0);
+		}
+
+		return 1;
+	}
+
+	memo->misses++;
+	seen = memo->seen + (hash & (MEMO_SEEN - 1));
+	key = hash ^ (unsigned int) macros->generation * 2654435761u;
+
+	// Most calls are only made once (for a given table), recording them
+	// would be wasted
+	if (*seen != key)
+	{
+		*seen = key;
+		return 0;
+	}
+
+	if (out->recordCount == out->recordCapacity)
+	{
+		out->recordCapacity = out->recordCapacity ? out->recordCapacity * 2 : INIT_RECORDS;
+
+		if (!(out->records = realloc(out->records, out->recordCapacity * sizeof(record_t))))
+			DIE("%s", "Bad memory memoCall\n");
+	}
+
+	if (!out->recorded && !(out->recorded = malloc(MEMO_ENTRY_MAX)))
+		DIE("%s", "Bad memory memoCall\n");
+
+	record = out->records + out->recordCount++;
+	record->mark = createNode(arg->buf, arg->data, arg->len, NULL);
+	record->mark->kind = TOKEN_MARK;
+	record->mark->frame = retainFrame(s->frame);
+	record->macro = macro;
+	record->hash = hash;
+	record->generation = macros->generation;
+	record->document = macros->documents;
+	record->includes = includes->hits + includes->misses;
+	record->start = out->recordedLen;
+	out->live++;
+
+	pushNode(s, record->mark);
+
+	return 0;
+}
+
+void giveUpRecord(sink_t *out, record_t *record)
+{
+	if (record->start < 0)
+		return;
+
+	record->start = -1;
+
+	if (!--out->live)
+		out->recordedLen = 0;
+}
+
+// Output while calls are recorded. Those it makes longer than
+// MEMO_ENTRY_MAX are given up on, and what only they needed goes.
+void recordOutput(sink_t *out, char *data, int len)
+{
+	record_t *record;
+	int first = -1;
+
+	if (!out->live)
+		return;
+
+	if (out->recordedLen + len > MEMO_ENTRY_MAX)
+	{
+		for (record = out->records; record < out->records + out->recordCount; record++)
+		{
+			if (record->start >= 0 && out->recordedLen + len - record->start > MEMO_ENTRY_MAX)
+				giveUpRecord(out, record);
+			else if (record->start >= 0 && first < 0)
+				first = record->start;
+		}
+
+		if (first < 0)
+			return;
+
+		memmove(out->recorded, out->recorded + first, out->recordedLen - first);
+		out->recordedLen -= first;
+
+		for (record = out->records; record < out->records + out->recordCount; record++)
+			if (record->start >= 0)
+				record->start -= first;
+	}
+
+	memcpy(out->recorded + out->recordedLen, data, len);
+	out->recordedLen += len;
+}
+
+// processChunks got to mark: the call is done. It is kept unless it
+// was given up on, defined or undefined anything or read a file.
+void finishRecord(sink_t *out, macrolist_t *macros, includes_t *includes, node_t *mark)
+{
+	record_t *record;
+
+	// Those after it were given up on
+	while (out->recordCount && out->records[out->recordCount - 1].mark != mark)
+		out->recordCount--;
+
+	if (!out->recordCount)
+		return;
+
+	record = out->records + --out->recordCount;
+
+	if (record->start >= 0 && record->generation == macros->generation &&
+		record->includes == includes->hits + includes->misses)
+		storeMemo(macros->memo, record, out->recorded + record->start, out->recordedLen - record->start);
+
+	giveUpRecord(out, record);
+}
+
+// How many chunks after it a macro takes
+int macroArgs(int macro)
+{
+	switch (macro)
+	{
+		case NOT_FOUND:
+			return 0;
+
+		case IFDEF:
+		case IF:
+			return 3;
+
+		case DEF:
+		case EXPANDAFTER:
+			return 2;
+
+		default:
+			return 1;
+	}
+}
+
+// The head of s is about to take count chunks after it: text among
+// them not chunked yet is, and calls being recorded whose expansion that
+// reaches past are given up on, their marks taken out of the way
+void reach(stack_t *s, sink_t *out, int count)
+{
+	node_t **at = &s->head->next, *node;
+	int i, found = 0;
+
+	while (*at && count)
+	{
+		if ((node = *at)->kind == TOKEN_RANGE)
+		{
+			openRange(s, at);
+			continue;
+		}
+
+		if (node->kind != TOKEN_MARK)
+		{
+			at = &node->next;
+			count--;
+			continue;
+		}
+
+		*at = node->next;
+		s->size--;
+		s->bytes -= node->len;
+
+		for (i = out->recordCount - 1; i >= 0 && out->records[i].mark != node; i--)
+			;
+
+		if (i >= 0)
+		{
+			giveUpRecord(out, out->records + i);
+			out->records[i].mark = NULL;
+		}
+
+		destroyNode(node);
+		found = 1;
+	}
+
+	// The marks took up some of the lookahead
+	if (found)
+		fill(s, LOOKAHEAD);
+}
+
+// Make sure s holds n chunks, as far as the input goes. Reading might
+// block, so the output catches up first. Returns how many s holds.
+int awaitInput(stack_t *s, sink_t *out, int n)
+{
+	long flushStart;
+
+	if (!s->src)
+		return s->size;
+
+	if (stats.enabled)
+	{
+		flushStart = nowNs();
+		flushSink(out);
+		stats.outputNs += nowNs() - flushStart;
+	}
+	else flushSink(out);
+
+	fill(s, n);
+
+	return s->size;
+}
+
+void processChunks(stack_t *s, macrolist_t *macros, includes_t *includes, sink_t *out)
+{
+	int macroId, len, start, end;
+	char *filename;
+	string_t *arg1, *before;
+	stack_t *beforeStack;
+	sink_t *beforeOut;
+	node_t *node;
+	mark_t mark;
+	long nestedStart = 0;
+
+	while ((s->head || awaitInput(s, out, 1)) && s->head != s->stop)
+	{
+		if (s->head->kind == TOKEN_RANGE)
+		{
+			openRange(s, &s->head);
+			continue;
+		}
+
+		// Only a control word or an ESCAPE looks at the chunks after it,
+		// text already lexed is written out without waiting for more
+		if (s->src && s->size < LOOKAHEAD && s->head->data[0] == ESCAPE)
+			awaitInput(s, out, LOOKAHEAD);
+
+		if (framing)
+		{
+			endStep(s);
+			beginStep(s);
+
+			if (limits.on)
+				checkLimits(s, macros, NOT_FOUND);
+		}
+
+		switch (s->head->kind)
+		{
+			case TOKEN_ESCAPE:
+				reach(s, out, 1);
+
+				if (s->head->next && isSpecialCharacter(s->head->next->data[0]))
+				{
+					len = 1 + s->head->next->len;
+					arg1 = newString(len);
+
+					arg1->charAt[0] = ESCAPE;
+					memcpy(arg1->charAt + 1, s->head->next->data, s->head->next->len);
+
+					destroyNode(pop(s));
+					destroyNode(pop(s));
+
+					push(s, arg1, arg1->charAt, len);
+					destroyString(arg1);
+				}
+
+				writeChunk(out, pop(s), 0);
+				break;
+
+			case TOKEN_ESCAPED:
+				writeChunk(out, pop(s), 1);
+				break;
+
+			case TOKEN_WORD:
+				macroId = findMacro(s->head->data, s->head->len, macros);
+
+				reach(s, out, macroArgs(macroId));
+
+				if (framing && macroId != NOT_FOUND)
+				{
+					enterFrame(s, macroId);
+
+					if (trace.emit)
+						openSpan(s, macros, macroId);
+
+					if (limits.on)
+						checkLimits(s, macros, macroId);
+				}
+
+				switch (macroId)
+				{
+					case NOT_FOUND:
+						DIE("%s", "Invalid macro\n");
+						break;
+
+					case DEF:
+						if (!s->head->next || !s->head->next->next)
+						{
+							DIE("%s", "Missing argument(s) for def\n");
+						}
+
+						macroId = findMacro(s->head->next->data, s->head->next->len, macros);
+
+						if (macroId != NOT_FOUND)
+						{
+							DIE("%s", "Macro already defined\n");
+						}
+
+						if (!isValidDefArg(s->head->next) ||
+							!isValidArg(s->head->next->next))
+						{
+							DIE("%s", "Bad argument(s) for def\n");
+						}
+
+						if (!argIsAlnum(s->head->next->data, s->head->next->len))
+						{
+							DIE("%s", "New defenition requires alpha-numberic chars only\n");
+						}
+
+						def(macros, s->head->next->data, s->head->next->len,
+							s->head->next->next->data, s->head->next->next->len);
+
+						destroyNode(pop(s));
+						destroyNode(pop(s));
+						destroyNode(pop(s));
+
+						break;
+
+					case UNDEF:
+						if (!s->head->next)
+						{
+							DIE("%s", "Missing argument(s) for def\n");
+						}
+
+						macroId = findMacro(s->head->next->data, s->head->next->len, macros);
+
+						if (macroId == NOT_FOUND)
+						{
+							DIE("%s", "Macro is not defined (can't undef)\n");
+						}
+
+						if (macroId < PROTECTED_MACROS)
+						{
+							DIE("%s", "Can't undef protected macros\n");
+						}
+
+						undef(macros, macroId);
+
+						destroyNode(pop(s));
+						destroyNode(pop(s));
+
+						break;
+
+					case IFDEF:
+						if (!s->head->next || !s->head->next->next ||
+							!s->head->next->next->next)
+						{
+							DIE("%s", "Missing argument(s) for if ifdef\n");
+						}
+
+						if (!isValidArg(s->head->next) ||
+							!isValidArg(s->head->next->next) || 
+							!isValidArg(s->head->next->next->next))
+						{
+							DIE("%s", "Bad argument(s) for ifdef\n");
+						}
+
+						if (findMacro(s->head->next->data, s->head->next->len, macros) == NOT_FOUND)
+							node = s->head->next->next->next;
+						else node = s->head->next->next;
+
+						before = argContents(node, &start, &end);
+
+						// ifdef (DEF) (THEN) (ELSE)
+						destroyNode(pop(s));	// ifdef
+						destroyNode(pop(s));	// (DEF)
+						destroyNode(pop(s));	// (THEN)
+						destroyNode(pop(s));	// (ELSE)
+
+						chunkRange(before, start, end, s);
+						destroyString(before);
+
+						break;
+
+					case IF:
+						if (!s->head->next || !s->head->next->next ||
+							!s->head->next->next->next)
+						{
+							DIE("%s", "Missing argument(s) for if\n");
+						}
+
+						if (!isValidArg(s->head->next) ||
+							!isValidArg(s->head->next->next) || 
+							!isValidArg(s->head->next->next->next))
+						{
+							DIE("%s", "Bad argument(s) for if\n");
+						}
+
+						if (s->head->next->len < 3)
+							node = s->head->next->next->next;
+						else node = s->head->next->next;
+
+						before = argContents(node, &start, &end);
+
+						// TODO: popn(s, 4);
+						destroyNode(pop(s));
+						destroyNode(pop(s));
+						destroyNode(pop(s));
+						destroyNode(pop(s));
+						
+						chunkRange(before, start, end, s);
+						destroyString(before);
+						break;
+
+					case INCLUDE:
+						if (!s->head->next)
+						{
+							DIE("%s", "Missing argument(s) for if include\n");
+						}
+						
+						if (!isValidArg(s->head->next))
+						{
+							DIE("%s", "Bad argument(s) for include\n");
+						}
+
+						mark = arenaMark(&scratch);
+						filename = removeBraces(s->head->next->data, s->head->next->len, &scratch);
+						
+						destroyNode(pop(s));
+						destroyNode(pop(s));
+						
+						includeFile(includes, filename, s);
+						arenaRelease(&scratch, mark);
+						break;
+
+					case EXPANDAFTER:
+						if (!s->head->next || !s->head->next->next)
+						{
+							DIE("%s", "Missing argument(s) for expandafter\n");
+						}
+
+						if (!isValidArg(s->head->next) ||
+							!isValidArg(s->head->next->next))
+						{
+							DIE("%s", "Bad argument(s) for expandafter\n");
+						}
+
+						destroyNode(pop(s));
+
+						// The document holds on to the capture until it is
+						// done, a failure in the nested expansion lets go of it
+						beforeOut = createSink(NULL, NULL);
+						beforeOut->outer = current->doc.nested;
+						current->doc.nested = beforeOut;
+
+						// After
+						beforeOut->after = pop(s);
+
+						// Before
+						node = pop(s);
+						beforeStack = beforeOut->input = createStack();
+						beforeStack->frame = retainFrame(s->frame);
+
+						arg1 = argContents(node, &start, &end);
+						chunkRange(arg1, start, end, beforeStack);
+						destroyString(arg1);
+						destroyNode(node);
+
+						if (trace.emit)
+							nestedStart = nowNs();
+
+						processChunks(beforeStack, macros, includes, beforeOut);
+						current->doc.nested = beforeOut->outer;
+
+						if (trace.emit)
+							traceNested(s, nestedStart, beforeOut->chunks->size);
+
+						chunkAfter(beforeOut->after, beforeOut->chunks, s);
+						destroySink(beforeOut);
+						break;
+					default:
+						if (!s->head->next)
+						{
+							DIE("%s", "Missing argument(s) for custom macro\n");
+						}
+						if (!isValidArg(s->head->next))
+						{
+							DIE("%s", "Bad argument(s) for custom macro\n");
+						}
+
+						// Substitute straight from the argument's chunk
+						destroyNode(pop(s));
+						node = pop(s);
+
+						if (!memoCall(s, macros, includes, out, macroId, node))
+							expandTemplate(macros->arr[macroId]->body, node->data + 1, node->len - 2, s);
+
+						destroyNode(node);
+						break;
+				}
+				break;
+
+			case TOKEN_MARK:
+				node = pop(s);
+				finishRecord(out, macros, includes, node);
+				destroyNode(node);
+				break;
+
+			case TOKEN_GROUP:
+				node = pop(s);
+
+				// The group's own braces, so the output stays one run
+				if ((len = bracesEnd(node->data, node->len)) < node->len)
+					push(s, node->buf, node->data + len, 1);
+				else push(s, NULL, BRACE_CLOSE_STR, 1);
+
+				chunkContents(node, s);
+				push(s, node->buf, node->data, 1);
+
+				destroyNode(node);
+				break;
+
+			default:
+				writeChunk(out, pop(s), 0);
+				break;
+		}
+	}
+
+	if (framing)
+		endStep(s);
+}
+
+// How long the literal run at the start of c[0, n) is: the characters
+// before the first one the lexer has to look at
+int skipLiteralScalar(const char *c, int n)
+{
+	int i;
+
+	for (i = 0; i < n && !(charClass[(unsigned char) c[i]] & CLASS_LEX); i++)
+		;
+
+	return i;
+}
+
+#ifdef SCAN_SSE2
+int skipLiteralSSE2(const char *c, int n)
+{
+	const __m128i esc = _mm_set1_epi8(ESCAPE), open = _mm_set1_epi8(BRACE_OPEN),
+		close = _mm_set1_epi8(BRACE_CLOSE), comment = _mm_set1_epi8(COMMENT_START),
+		newLine = _mm_set1_epi8(NEW_LINE);
+	__m128i v, hit;
+	int i, mask;
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i *) (c + i));
+		hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, esc), _mm_cmpeq_epi8(v, open)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, close), _mm_cmpeq_epi8(v, comment)));
+		hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, newLine));
+
+		if ((mask = _mm_movemask_epi8(hit)))
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + skipLiteralScalar(c + i, n - i);
+}
+#endif
+
+#ifdef SCAN_AVX2
+__attribute__((target("avx2")))
+int skipLiteralAVX2(const char *c, int n)
+{
+	const __m256i esc = _mm256_set1_epi8(ESCAPE), open = _mm256_set1_epi8(BRACE_OPEN),
+		close = _mm256_set1_epi8(BRACE_CLOSE), comment = _mm256_set1_epi8(COMMENT_START),
+		newLine = _mm256_set1_epi8(NEW_LINE);
+	__m256i v, hit;
+	unsigned int mask;
+	int i;
+
+	for (i = 0; i + 32 <= n; i += 32)
+	{
+		v = _mm256_loadu_si256((const __m256i *) (c + i));
+		hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, esc), _mm256_cmpeq_epi8(v, open)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, close), _mm256_cmpeq_epi8(v, comment)));
+		hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, newLine));
+
+		if ((mask = _mm256_movemask_epi8(hit)))
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + skipLiteralScalar(c + i, n - i);
+}
+#endif
+
+int skipLiteralInit(const char *c, int n);
+
+// Set to the widest scanner the CPU has on first use
+static int (*skipLiteralBest)(const char *c, int n) = skipLiteralInit;
+
+int skipLiteralInit(const char *c, int n)
+{
+	skipLiteralBest = skipLiteralScalar;
+
+#ifdef SCAN_SSE2
+	skipLiteralBest = skipLiteralSSE2;
+#endif
+#ifdef SCAN_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		skipLiteralBest = skipLiteralAVX2;
+#endif
+
+	return skipLiteralBest(c, n);
+}
+
+int skipLiteral(const char *c, int n)
+{
+#ifdef SCAN_CHECK
+	int run = skipLiteralBest(c, n);
+
+	if (run != skipLiteralScalar(c, n))
+		DIE("%s", "Vector scan differs from scalar scan\n");
+
+	return run;
+#else
+	return skipLiteralBest(c, n);
+#endif
+}
+
+// Chunking sees a NUL at (and past) the end of its range
+char peekChar(char *c, int end, int i)
+{
+	return i < end ? c[i] : '\0';
+}
+
+// Queue str[from, from + len) (less the comment in between commentStart
+// and commentEnd) at the end of the list **tail. Plain chunks are views
+// into str, with flags (as long as they are all there); only a chunk
+// that spans a comment needs a copy.
+int pushChunk(node_t ***tail, string_t *str, int end, int from, int commentStart, int commentEnd, int len, int flags)
+{
+	char *c = str->charAt, *data, *nul;
+	string_t *copy;
+	int i, j, whole = len;
+
+	if (from < 0)
+		return 0;
+
+	if (commentStart != commentEnd)
+	{
+		copy = newString(len);
+		data = copy->charAt;
+
+		for (i = 0; i + from < commentStart && peekChar(c, end, i + from); i++)
+		{
+			data[i] = c[i + from];
+			len--;
+		}
+
+		for (j = 0; len-- && peekChar(c, end, j + commentEnd); j++)
+			data[i++] = c[j + commentEnd];
+
+		if (!i)
+		{
+			destroyString(copy);
+			return 0;
+		}
+
+		data[i] = '\0';
+		copy->length = i;
+		**tail = createNode(copy, data, i, NULL);
+		destroyString(copy);
+	}
+	else
+	{
+		if (from >= end)
+			return 0;
+
+		if (len > end - from)
+			len = end - from;
+
+		if ((nul = memchr(c + from, '\0', len)))
+			len = nul - (c + from);
+
+		if (!len)
+			return 0;
+
+		**tail = createNode(str, c + from, len, NULL);
+		(**tail)->flags = len == whole ? flags : flags & ~TOKEN_BALANCED;
+	}
+
+	*tail = &(**tail)->next;
+
+	return 1;
+}
+
+void chunkString(string_t *str, stack_t *s)
+{
+	chunkRange(str, 0, str->length, s);
+}
+
+// Chunk str[start, end) onto s. The chunks are collected in order and
+// spliced in front of s in one go. Longer text (a whole document, a big
+// branch of an \if) is pushed as a range instead and chunked a block at
+// a time as it is reached, so it is never all chunks at once.
+void chunkRange(string_t *str, int start, int end, stack_t *s)
+{
+	node_t *first = NULL, **tail = &first;
+	int count;
+
+	if (end - start > RANGE_BLOCK)
+	{
+		push(s, str, str->charAt + start, end - start);
+		s->head->kind = TOKEN_RANGE;
+		return;
+	}
+
+	count = lexChunks(str, start, end, NULL, &tail);
+	spliceChunks(s, first, tail, count);
+}
+
+// Chunk the next block of the range *at where it is: the chunks up to
+// the last point chunking can start over from go in front of what is
+// left of it. Returns the number of chunks added.
+int openRange(stack_t *s, node_t **at)
+{
+	node_t *range = *at, *first = NULL, **tail = &first, *node;
+	string_t *str = range->buf;
+	int start = range->data - str->charAt, end = start + range->len;
+	int stop = start, safe, count;
+
+	// A macro taking arguments from it: the expansion goes on into it
+	if (range == s->stop)
+		s->stop = NULL;
+
+	do
+	{
+		// Widen eightfold past a long line (or group), so little of it
+		// is gone over twice
+		if (stop == start)
+			stop += RANGE_BLOCK;
+		else if (stop - start < (end - start) / 8)
+			stop = start + (stop - start) * 8;
+		else stop = end;
+
+		if (stop >= end)
+		{
+			count = lexChunks(str, start, end, NULL, &tail);
+			safe = end;
+			break;
+		}
+
+		count = lexBlock(str, start, stop, end, &safe, &tail);
+	} while (!count);
+
+	s->bytes -= safe - start;
+
+	for (node = first; node; node = node->next)
+	{
+		if (range->frame)
+			node->frame = retainFrame(range->frame);
+
+		s->bytes += node->len;
+	}
+
+	s->size += count;
+
+	if (safe < end)
+	{
+		range->data = str->charAt + safe;
+		range->len = end - safe;
+		*tail = range;
+	}
+	else
+	{
+		*tail = range->next;
+		destroyNode(range);
+		s->size--;
+	}
+
+	*at = first;
+
+	return count;
+}
+
+// Add an entry to str's brace index for the group opening at open
+// (inside the one with entry parent), returns it
+int openGroup(string_t *str, int open, int parent)
+{
+	braceindex_t *index = str->braces;
+	group_t *group;
+	int capacity = index ? index->capacity * 2 : INIT_GROUPS;
+
+	if (!index || index->count == index->capacity)
+	{
+		if (!(index = realloc(index, sizeof(braceindex_t) + capacity * sizeof(group_t))))
+			DIE("%s", "Bad memory openGroup\n");
+
+		if (!str->braces)
+			index->end = index->clean = index->count = 0;
+
+		index->capacity = capacity;
+		str->braces = index;
+	}
+
+	group = index->groups + index->count;
+	group->open = open;
+	group->close = -1;
+	group->next = parent;
+	group->plain = 1;
+	group->miscounted = 0;
+
+	return index->count++;
+}
+
+// The group with entry top closes at close, returns the entry of the
+// group around it
+int closeGroup(braceindex_t *index, int top, int close)
+{
+	group_t *group = index->groups + top;
+	int parent = group->next;
+
+	group->close = close;
+	group->next = index->count;
+
+	if (!group->plain && parent >= 0)
+		index->groups[parent].plain = 0;
+
+	if (group->miscounted && parent >= 0)
+		index->groups[parent].miscounted = 1;
+
+	return parent;
+}
+
+// First entry of a group opening at offset or after
+int findGroup(braceindex_t *index, int offset)
+{
+	int low = 0, high = index->count, mid;
+
+	while (low < high)
+	{
+		mid = (low + high) / 2;
+
+		if (index->groups[mid].open < offset)
+			low = mid + 1;
+		else high = mid;
+	}
+
+	return low;
+}
+
+// Where the group of str opening at open closes, if it has an entry
+// from *cursor on (and closes before end) and chunks as a view of all
+// of it, else -1. *cursor moves on past the entries of the groups
+// inside it, *flags gets the chunk's.
+int skipGroup(string_t *str, int *cursor, int open, int end, int *flags)
+{
+	braceindex_t *index = str->braces;
+	group_t *group;
+	char *nul;
+
+	for (; *cursor < index->count && index->groups[*cursor].open < open; ++*cursor)
+		;
+
+	if (*cursor == index->count)
+		return -1;
+
+	group = index->groups + *cursor;
+
+	if (group->open != open || !group->plain || group->close >= end)
+		return -1;
+
+	// Each byte is looked at for a NUL once, not once a level
+	if (index->clean <= group->close)
+	{
+		if ((nul = memchr(str->charAt + index->clean, '\0', group->close + 1 - index->clean)))
+		{
+			index->clean = nul - str->charAt;
+			return -1;
+		}
+
+		index->clean = group->close + 1;
+	}
+
+	*cursor = group->next;
+	*flags = group->miscounted ? 0 : TOKEN_BALANCED;
+
+	return group->close;
+}
+
+// Forget the groups opening before offset (all of them closed)
+void dropGroups(braceindex_t *index, int offset)
+{
+	int first = findGroup(index, offset), i;
+
+	if (!first)
+		return;
+
+	index->count -= first;
+	memmove(index->groups, index->groups + first, index->count * sizeof(group_t));
+
+	for (i = 0; i < index->count; i++)
+		index->groups[i].next -= first;
+}
+
+// Chunk str[start, end) onto the list ending at *tailp, returns the
+// number of chunks. With safe set, end is only where the input read
+// so far ends: just the chunks up to the last point chunking can
+// start over from (after a newline or a group, at the top level) are
+// kept, and *safe is set to that point.
+//
+// Text gone over for the first time has its deeply nested groups
+// entered in str's brace index; text gone over before (the contents
+// of a group) has them taken whole from it.
+int lexChunks(string_t *str, int start, int end, int *safe, node_t ***tailp)
+{
+	return lexBlock(str, start, end, end, safe, tailp);
+}
+
+// lexChunks for a block of text that goes on to limit: a group taken
+// whole from the brace index may close past end, as long as it closes
+// before limit
+int lexBlock(string_t *str, int start, int end, int limit, int *safe, node_t ***tailp)
+{
+	// Capture from i to end
+	// when reaching %, brace, escape
+	int braces, chunkLen, i, commentLen, commentStart, count, safeCount, run;
+	int indexing, top = -1, cursor = 0, safeGroups, close, escapes = 0, miscounted = 0, flags;
+	char *c = str->charAt;
+	node_t **tail = *tailp, **safeTail = tail, *node;
+	braceindex_t *index = str->braces;
+	long lexStart = 0, lexEnd;
+
+	if (stats.enabled || trace.emit)
+		lexStart = nowNs();
+
+	if (safe)
+		*safe = start;
+
+	if (!(indexing = !index || start >= index->end))
+		cursor = findGroup(index, start);
+
+	safeGroups = index ? index->count : 0;
+
+	// NOTE: i - commentLen - chunkLen
+
+	commentLen = braces = chunkLen = commentStart = count = safeCount = 0;
+	for (i = start; i <= end; i++)
+	{
+		switch (peekChar(c, end, i))
+		{
+			case COMMENT_START:
+				if (indexing && top >= 0)
+					str->braces->groups[top].plain = 0;
+
+				// End chunk
+				if (chunkLen && !commentLen && !braces)
+				{
+					count += pushChunk(&tail, str, end, i - chunkLen, 0, 0, chunkLen, escapes ? 0 : TOKEN_UNESCAPED);
+					chunkLen = escapes = miscounted = 0;
+				}
+
+				// Init
+				commentLen = 0;
+				do
+				{
+					// Count '%' (COMMENT_START)
+					commentLen++;
+					
+					// Discard everything on this line
+					for (; ++i <= end && peekChar(c, end, i) != NEW_LINE; commentLen++)
+						;
+
+					// Discard whitespace on next line
+					for (commentLen++; ++i <= end && (charClass[(unsigned char) peekChar(c, end, i)] & CLASS_SPACE); commentLen++)
+						;
+
+					// Preserve first non-whitespace character
+					--commentLen;
+				} while (i <= end && peekChar(c, end, i--) == COMMENT_START);
+
+				commentStart = i - commentLen++;
+
+				
+				if (!braces)
+					commentLen = 0;
+				// else commentLen++;
+				break;
+			
+			case BRACE_OPEN:
+				// There are no braces and there is a chunk
+				if (!braces && chunkLen)
+				{
+					count += pushChunk(&tail, str, end, i - chunkLen - commentLen,
+						commentStart, commentStart + commentLen, chunkLen, escapes ? 0 : TOKEN_UNESCAPED);
+					
+					chunkLen = commentLen = commentStart = escapes = miscounted = 0;
+				}
+
+				// A group gone over before is taken whole
+				if (!braces && !indexing && (close = skipGroup(str, &cursor, i, limit, &flags)) >= 0)
+				{
+					*tail = createNode(str, c + i, close - i + 1, NULL);
+					(*tail)->flags = flags;
+					tail = &(*tail)->next;
+					count++;
+
+					commentLen = commentStart = 0;
+					i = close;
+
+					if (safe)
+					{
+						safeTail = tail;
+						safeCount = count;
+						*safe = i + 1;
+					}
+					break;
+				}
+
+				if (indexing && braces >= INDEX_DEPTH)
+					top = openGroup(str, i, top);
+
+				// Include in chunk
+				chunkLen++;
+
+				// Increment braces count
+				braces++;
+				break;
+
+			case BRACE_CLOSE:
+				// Include in chunk
+				chunkLen++;
+
+				if (indexing && braces > INDEX_DEPTH)
+					top = closeGroup(str->braces, top, i);
+				
+				// Close brace and check if chunk is closed too
+				if (!--braces)
+				{
+					// A copy around a comment is not known to be whole
+					count += pushChunk(&tail, str, end, i - chunkLen - commentLen + 1,
+						commentStart, commentStart + commentLen, chunkLen,
+						(commentLen || miscounted ? 0 : TOKEN_BALANCED) | (escapes ? 0 : TOKEN_UNESCAPED));
+					
+					chunkLen = commentLen = commentStart = escapes = miscounted = 0;
+
+					if (safe)
+					{
+						safeTail = tail;
+						safeCount = count;
+						safeGroups = str->braces ? str->braces->count : 0;
+						*safe = i + 1;
+					}
+				}
+				break;
+
+			case NEW_LINE:
+				if (braces)
+					chunkLen++; // Include in chunk
+				else
+				{
+					if (chunkLen)
+					{
+						count += pushChunk(&tail, str, end, i - chunkLen - commentLen,
+							commentStart, commentStart + commentLen, chunkLen, escapes ? 0 : TOKEN_UNESCAPED);
+						
+						chunkLen = commentLen = commentStart = escapes = miscounted = 0;
+					}
+					count += pushChunk(&tail, str, end, i, 0, 0, 1, TOKEN_UNESCAPED);
+
+					if (safe)
+					{
+						safeTail = tail;
+						safeCount = count;
+						safeGroups = str->braces ? str->braces->count : 0;
+						*safe = i + 1;
+					}
+				}
+				break;
+			
+			case ESCAPE:
+				// Check if has next character
+				if (i + 1 > end)
+				{
+					// TODO: invalid syntax
+					// Break out of loop..
+				}
+
+				// If next character is special character (%, {, }, \, #)
+				if (isSpecialCharacter(peekChar(c, end, i + 1)))
+				{
+					// isValidArg does not count a brace after this pair
+					if (peekChar(c, end, i + 1) == ESCAPE && i + 2 <= end &&
+						(peekChar(c, end, i + 2) == BRACE_OPEN || peekChar(c, end, i + 2) == BRACE_CLOSE))
+					{
+						miscounted = 1;
+
+						if (indexing && top >= 0)
+							str->braces->groups[top].miscounted = 1;
+					}
+
+					i++;			// Skip processing next character
+					chunkLen++;	 // Include in chunk
+				}
+
+				else if (chunkLen && !braces)
+				{
+					count += pushChunk(&tail, str, end, i - chunkLen - commentLen,
+						commentStart, commentStart + commentLen, chunkLen, escapes ? 0 : TOKEN_UNESCAPED);
+					
+					chunkLen = commentLen = commentStart = miscounted = 0;
+				}
+				
+				// Include in chunk
+				chunkLen++;
+				escapes = 1;
+				break;
+				
+			default:
+				// Include in chunk, with the literal run after it
+				run = skipLiteral(c + i + 1, end - i - 1);
+				chunkLen += 1 + run;
+				i += run;
+				break;
+		}
+		// TODO: verify BRACES is not negative
+	}
+
+	if (chunkLen) // TODO: And validate braces/invalidc syntax for ESC char
+	{
+		count += pushChunk(&tail, str, end, i - chunkLen - commentLen,
+			commentStart, commentStart + commentLen, chunkLen, escapes ? 0 : TOKEN_UNESCAPED);
+	}
+
+	if (safe)
+	{
+		// Drop what may still change once more input is read
+		for (node = *safeTail; node; node = *safeTail)
+		{
+			*safeTail = node->next;
+			destroyNode(node);
+		}
+
+		tail = safeTail;
+		count = safeCount;
+	}
+
+	if (indexing && (index = str->braces))
+	{
+		// Groups still open are dropped with those inside them
+		for (; top >= 0 && index->groups[top].next >= 0; top = index->groups[top].next)
+			;
+
+		if (safe)
+			index->count = safeGroups;
+		else if (top >= 0)
+			index->count = top;
+
+		index->end = safe ? *safe : end;
+	}
+
+	*tailp = tail;
+
+	if (stats.enabled || trace.emit)
+	{
+		lexEnd = nowNs();
+
+		if (stats.enabled)
+		{
+			stats.lexNs += lexEnd - lexStart;
+			stats.chunksLexed += count;
+		}
+
+		if (trace.emit)
+			traceSpan("lex", "lex", lexStart, lexEnd, "\"chunks\": %d, \"bytes\": %d", count, end - start);
+	}
+
+	return count;
+}
+
+// The files, or what read returns when there are none
+source_t *createSource(char **files, int fileCount, proj1_read_t read, void *user)
+{
+	source_t *src = calloc(1, sizeof(source_t));
+	int i, j;
+
+	if (!src)
+		DIE("%s", "Bad memory createSource\n");
+
+	src->fd = -1;
+
+	if (!fileCount)
+	{
+		src->read = read;
+		src->user = user;
+		src->fd = read ? 0 : -1;
+		return src;
+	}
+
+	if (access(files[0], R_OK))
+		DIE("%s%s%s", "Invalid initial file (", files[0], ")\n");
+
+	src->names = src->files = malloc(fileCount * sizeof(char *));
+	src->files[0] = files[0];
+
+	for (i = j = 1; i < fileCount; i++)
+	{
+		if (access(files[i], R_OK))
+			WARN("%s%s%s", "Unable to open file ", files[i], "!\n");
+		else src->files[j++] = files[i];
+	}
+
+	src->fileCount = j;
+	openNextInput(src);
+
+	return src;
+}
+
+// Move on to the next input, 0 when there is none left
+int openNextInput(source_t *src)
+{
+	if (src->fd > STDIN_FILENO)
+		close(src->fd);
+
+	src->fd = -1;
+	src->map = destroyString(src->map);
+	src->mapPos = 0;
+
+	while (src->fileCount && src->fd < 0)
+	{
+		if ((src->fd = open(src->files[0], O_RDONLY)) < 0)
+			WARN("%s%s%s", "Unable to open file ", src->files[0], "!\n");
+		else src->map = mapFile(src->fd);
+
+		src->files++;
+		src->fileCount--;
+	}
+
+	return src->fd >= 0;
+}
+
+// Map all of fd, or NULL if it is not a (non-empty) regular file
+string_t *mapFile(int fd)
+{
+	string_t *str;
+	struct stat st;
+	char *data;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > INT_MAX)
+		return NULL;
+
+	if ((data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		return NULL;
+
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	str = poolAlloc(&stringPool);
+	str->charAt = data;
+	str->length = st.st_size;
+	str->refs = 0;
+	str->storage = STORE_MAP;
+	str->braces = NULL;
+
+	return str;
+}
+
+// Read up to n bytes of the current input into dst
+ssize_t readInput(source_t *src, char *dst, int n)
+{
+	if (src->read)
+		return src->read(src->user, dst, n);
+
+	if (!src->map)
+		return read(src->fd, dst, n);
+
+	if (n > src->map->length - src->mapPos)
+		n = src->map->length - src->mapPos;
+
+	memcpy(dst, src->map->charAt + src->mapPos, n);
+	src->mapPos += n;
+
+	return n;
+}
+
+// Chunk the next window of a mapped input where it lies. Only a line
+// left unfinished by the end of the file is carried over (copied) into
+// the next input.
+int refillMapped(stack_t *s)
+{
+	source_t *src = s->src;
+	string_t *map = src->map;
+	node_t **tail, **from;
+	int start = src->mapPos, end = start, safe, last, count, first = start;
+
+	for (tail = &s->head; *tail; tail = &(*tail)->next)
+		if ((*tail)->buf == map && (*tail)->data - map->charAt < first)
+			first = (*tail)->data - map->charAt;
+
+	// Groups before what is still pending are not looked up again
+	if (map->braces)
+		dropGroups(map->braces, first);
+
+	from = tail;
+
+	do
+	{
+		// Widen past a long line so it is chunked in O(n)
+		end += end - start > READ_BLOCK ? end - start : READ_BLOCK;
+
+		if (end > map->length || end < start)
+			end = map->length;
+
+		last = end == map->length;
+
+		if (last && !src->fileCount)
+		{
+			// Nothing follows, whatever is left is final
+			count = lexChunks(map, start, end, NULL, &tail);
+			s->size += count;
+			s->bytes += chunkBytes(*from);
+			s->src = NULL;
+
+			return count;
+		}
+
+		count = lexChunks(map, start, end, &safe, &tail);
+	} while (!count && !last);
+
+	s->size += count;
+	s->bytes += chunkBytes(*from);
+	src->mapPos = safe;
+
+	if (last)
+	{
+		if (safe < end)
+		{
+			src->carry = retainString(map);
+			src->carryStart = safe;
+		}
+
+		openNextInput(src);
+	}
+
+	return count;
+}
+
+// Read and chunk the next block(s) of input onto the bottom of s.
+// Returns the number of chunks added, 0 once the input is exhausted.
+int refill(stack_t *s)
+{
+	source_t *src = s->src;
+	string_t *buf;
+	node_t **tail, **from;
+	int remain, cap, len, safe, count = 0;
+	ssize_t n;
+
+	while (src && !count)
+	{
+		if (src->map && !src->carry)
+		{
+			count = refillMapped(s);
+			src = s->src;
+			continue;
+		}
+
+		remain = src->carry ? src->carry->length - src->carryStart : 0;
+
+		// Grow with the carry so a long line is read in O(n)
+		cap = remain + (remain > READ_BLOCK ? remain : READ_BLOCK);
+
+		buf = newString(cap);
+
+		if (remain)
+			memcpy(buf->charAt, src->carry->charAt + src->carryStart, remain);
+
+		src->carry = destroyString(src->carry);
+		len = remain;
+
+		while ((n = readInput(src, buf->charAt + len, cap - len)) <= 0)
+		{
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			if (n < 0)
+				WARN("%s", "Unable to read input\n");
+
+			if (!openNextInput(src))
+				break;
+		}
+
+		if (n > 0)
+			len += n;
+
+		buf->charAt[len] = '\0';
+		buf->length = len;
+
+		for (tail = &s->head; *tail; tail = &(*tail)->next)
+			;
+
+		from = tail;
+
+		if (src->fd < 0)
+		{
+			// All read, whatever is left is final
+			count = lexChunks(buf, 0, len, NULL, &tail);
+			s->src = src = NULL;
+		}
+		else
+		{
+			count = lexChunks(buf, 0, len, &safe, &tail);
+
+			if (safe < len)
+			{
+				src->carry = retainString(buf);
+				src->carryStart = safe;
+			}
+		}
+
+		s->size += count;
+		s->bytes += chunkBytes(*from);
+		destroyString(buf);
+	}
+
+	return count;
+}
+
+// Make sure s holds n chunks, as far as the input goes
+void fill(stack_t *s, int n)
+{
+	while (s->src && s->size < n && refill(s))
+		;
+}
+
+source_t *destroySource(source_t *src)
+{
+	if (!src)
+		return NULL;
+
+	if (src->fd > STDIN_FILENO)
+		close(src->fd);
+
+	destroyString(src->map);
+	destroyString(src->carry);
+	free(src->names);
+	free(src);
+
+	return NULL;
+}
+
+// The file is mapped when it can be, so its chunks are views of it
+// and nothing is read up front
+string_t *readFile(char *filename)
+{
+	string_t *str;
+	int fd, cap = INIT_BUF;
+	ssize_t n;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		DIE("%s%s%s", "Invalid initial file (", filename, ")\n");
+
+	if (!(str = mapFile(fd)))
+	{
+		str = newString(cap);
+		str->length = 0;
+
+		while ((n = read(fd, str->charAt + str->length, cap - str->length)) != 0)
+		{
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				break;
+			}
+
+			if ((str->length += n) == cap &&
+				!(str->charAt = realloc(str->charAt, (cap *= 2) + 1)))
+				DIE("%s", "Bad memory readFile\n");
+		}
+
+		str->charAt[str->length] = '\0';
+	}
+
+	close(fd);
+
+	return str;
+}
+
+string_t *readString(char *str)
+{
+	return createString(str);
+}
+
+includes_t *createIncludes(void)
+{
+	includes_t *includes = calloc(1, sizeof(includes_t));
+	int i;
+
+	if (!includes)
+		DIE("%s", "Bad memory createIncludes\n");
+
+	includes->capacity = INIT_INCLUDES;
+	includes->tableSize = 2 * INIT_INCLUDES;
+	includes->arr = malloc(includes->capacity * sizeof(incname_t *));
+	includes->slots = malloc(includes->tableSize * sizeof(int));
+	includes->files = malloc(includes->capacity * sizeof(incfile_t *));
+
+	if (!includes->arr || !includes->slots || !includes->files)
+		DIE("%s", "Bad memory createIncludes\n");
+
+	for (i = 0; i < includes->tableSize; i++)
+		includes->slots[i] = EMPTY_SLOT;
+
+	return includes;
+}
+
+incname_t *lookupInclude(includes_t *includes, const char *name, int len)
+{
+	unsigned int hash = hashName(name, len);
+	int mask = includes->tableSize - 1, i, id;
+	incname_t *inc;
+
+	for (i = hash & mask; (id = includes->slots[i]) != EMPTY_SLOT; i = (i + 1) & mask)
+	{
+		inc = includes->arr[id];
+		if (inc->hash == hash && inc->nameLen == len && !memcmp(inc->name, name, len))
+			return inc;
+	}
+
+	return NULL;
+}
+
+unsigned int includeHash(void *table, int id)
+{
+	return ((includes_t *) table)->arr[id]->hash;
+}
+
+// Map name (not yet in the table) to file
+incname_t *addInclude(includes_t *includes, const char *name, incfile_t *file)
+{
+	incname_t *inc;
+
+	// Expand (double size), the files never outnumber the names
+	if (includes->index == includes->capacity)
+	{
+		includes->capacity *= 2;
+		if (!(includes->arr = realloc(includes->arr, includes->capacity * sizeof(incname_t *))) ||
+			!(includes->files = realloc(includes->files, includes->capacity * sizeof(incfile_t *))))
+			DIE("%s", "Bad memory addInclude\n");
+	}
+
+	if (!(inc = malloc(sizeof(incname_t))) || !(inc->name = strdup(name)))
+		DIE("%s", "Bad memory addInclude\n");
+
+	inc->nameLen = strlen(name);
+	inc->hash = hashName(name, inc->nameLen);
+	inc->file = file;
+
+	includes->arr[includes->index] = inc;
+	putSlot(&includes->slots, &includes->tableSize, includes->index, inc->hash, includeHash, includes);
+	includes->index++;
+
+	return inc;
+}
+
+// (Re)read and chunk file, st is what it was just stat'ed as
+void loadInclude(incfile_t *file, struct stat *st)
+{
+	node_t **tail = &file->chunks;
+
+	destroyChunks(file->chunks);
+	file->chunks = NULL;
+	destroyString(file->text);
+
+	file->text = readFile(file->path);
+	file->hashed = 0;
+	file->mtime = st->st_mtim;
+	file->size = st->st_size;
+
+	lexChunks(file->text, 0, file->text->length, NULL, &tail);
+}
+
+// Push the chunks of filename onto s, from the cache when it can
+void includeFile(includes_t *includes, char *filename, stack_t *s)
+{
+	incname_t *inc = lookupInclude(includes, filename, strlen(filename));
+	incfile_t *file = inc ? inc->file : NULL;
+	node_t *first = NULL, **tail = &first;
+	struct stat st;
+	char *path;
+	int count, miss = 0;
+
+	if (!file || file->checked != includes->epoch)
+	{
+		// Resolve the name again, it may point somewhere else by now
+		if (!(path = realpath(filename, NULL)) || stat(path, &st))
+		{
+			free(path);
+			DIE("%s%s%s", "Invalid initial file (", filename, ")\n");
+		}
+
+		if (!file || strcmp(file->path, path))
+		{
+			if ((inc = lookupInclude(includes, path, strlen(path))))
+				file = inc->file;
+			else
+			{
+				if (!(file = calloc(1, sizeof(incfile_t))))
+					DIE("%s", "Bad memory includeFile\n");
+
+				file->path = strdup(path);
+				addInclude(includes, path, file);
+				includes->files[includes->fileCount++] = file;
+			}
+
+			if (!(inc = lookupInclude(includes, filename, strlen(filename))))
+				addInclude(includes, filename, file);
+			else inc->file = file;
+		}
+
+		free(path);
+
+		if (!file->text || file->size != st.st_size ||
+			file->mtime.tv_sec != st.st_mtim.tv_sec || file->mtime.tv_nsec != st.st_mtim.tv_nsec)
+		{
+			loadInclude(file, &st);
+			miss = 1;
+		}
+
+		file->checked = includes->epoch;
+	}
+
+	if (miss)
+		includes->misses++;
+	else includes->hits++;
+
+	if (current->doc.deps)
+		depFile(current->doc.deps, file, filename);
+
+	// Replay the chunks in front of s
+	count = copyChunks(file->chunks, &tail);
+	spliceChunks(s, first, tail, count);
+}
+
+includes_t *destroyIncludes(includes_t *includes)
+{
+	int i;
+
+	if (!includes)
+		return NULL;
+
+	for (i = 0; i < includes->fileCount; i++)
+	{
+		destroyChunks(includes->files[i]->chunks);
+		destroyString(includes->files[i]->text);
+		free(includes->files[i]->path);
+		free(includes->files[i]);
+	}
+
+	for (i = 0; i < includes->index; i++)
+	{
+		free(includes->arr[i]->name);
+		free(includes->arr[i]);
+	}
+
+	free(includes->arr);
+	free(includes->slots);
+	free(includes->files);
+	free(includes);
+
+	return NULL;
+}
+
+int compareCumulative(const void *a, const void *b)
+{
+	long x = stats.macros[*(const int *) a].cumulativeNs;
+	long y = stats.macros[*(const int *) b].cumulativeNs;
+
+	return x < y ? 1 : x > y ? -1 : *(const int *) a - *(const int *) b;
+}
+
+// Report the counters on fp: macros that were invoked (and the
+// built-ins) by cumulative time, then the totals
+void printStats(macrolist_t *macros, includes_t *includes, FILE *fp, int json)
+{
+	macrostats_t *m;
+	int *ids, count = 0, i;
+	long expandNs = stats.totalNs - stats.lexNs - stats.outputNs;
+	memo_t *memo = macros->memo;
+	long memoHits = memo ? memo->hits : 0, memoMisses = memo ? memo->misses : 0;
+	long memoEvictions = memo ? memo->evictions : 0, memoBytes = memo ? memo->bytes : 0;
+
+	// Room for every macro, counted or not
+	growStats(macros->index);
+
+	if (!(ids = malloc(macros->index * sizeof(int))))
+		DIE("%s", "Bad memory printStats\n");
+
+	for (i = 0; i < macros->index; i++)
+		if (i < PROTECTED_MACROS || stats.macros[i].calls)
+			ids[count++] = i;
+
+	qsort(ids, count, sizeof(int), compareCumulative);
+
+	if (json)
+	{
+		fprintf(fp, "{\"totalMs\": %.3f, \"lexMs\": %.3f, \"expandMs\": %.3f, \"outputMs\": %.3f, ",
+			stats.totalNs / 1e6, stats.lexNs / 1e6, expandNs / 1e6, stats.outputNs / 1e6);
+		fprintf(fp, "\"peakStack\": %d, \"chunksLexed\": %ld, \"chunksReplayed\": %ld, ",
+			stats.peakStack, stats.chunksLexed, stats.chunksReplayed);
+		fprintf(fp, "\"includeHits\": %ld, \"includeMisses\": %ld, ", includes->hits, includes->misses);
+		fprintf(fp, "\"memoHits\": %ld, \"memoMisses\": %ld, \"memoEvictions\": %ld, \"memoBytes\": %ld, ",
+			memoHits, memoMisses, memoEvictions, memoBytes);
+		fprintf(fp, "\"topLevel\": {\"selfMs\": %.3f, \"bytes\": %ld}, \"macros\": [",
+			stats.top.selfNs / 1e6, stats.top.bytes);
+
+		// Names are alphanumeric, nothing to escape
+		for (i = 0; i < count; i++)
+		{
+			m = stats.macros + ids[i];
+			fprintf(fp, "%s{\"name\": \"%s\", \"calls\": %ld, \"cumulativeMs\": %.3f, \"selfMs\": %.3f, \"bytes\": %ld}",
+				i ? ", " : "", macros->arr[ids[i]]->name, m->calls, m->cumulativeNs / 1e6, m->selfNs / 1e6, m->bytes);
+		}
+
+		fprintf(fp, "]}\n");
+	}
+	else
+	{
+		fprintf(fp, "%-20s %10s %12s %12s %12s\n", "macro", "calls", "cum ms", "self ms", "bytes");
+
+		for (i = 0; i < count; i++)
+		{
+			m = stats.macros + ids[i];
+			fprintf(fp, "%-20s %10ld %12.3f %12.3f %12ld\n",
+				macros->arr[ids[i]]->name, m->calls, m->cumulativeNs / 1e6, m->selfNs / 1e6, m->bytes);
+		}
+
+		fprintf(fp, "%-20s %10s %12s %12.3f %12ld\n", "(top level)", "", "", stats.top.selfNs / 1e6, stats.top.bytes);
+		fprintf(fp, "time: %.3f ms (lex %.3f, expand %.3f, output %.3f)\n",
+			stats.totalNs / 1e6, stats.lexNs / 1e6, expandNs / 1e6, stats.outputNs / 1e6);
+		fprintf(fp, "peak stack: %d chunks\n", stats.peakStack);
+		fprintf(fp, "chunks: %ld lexed, %ld replayed\n", stats.chunksLexed, stats.chunksReplayed);
+		fprintf(fp, "include cache: %ld hits, %ld misses\n", includes->hits, includes->misses);
+		fprintf(fp, "expansion cache: %ld hits, %ld misses, %ld evicted, %ld bytes kept\n",
+			memoHits, memoMisses, memoEvictions, memoBytes);
+	}
+
+	free(ids);
+}
+
+// FNV-1a, taken a word at a time so checking an image stays cheap
+uint64_t hashImage(const char *data, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL, word;
+	size_t i;
+
+	for (i = 0; i + sizeof(word) <= len; i += sizeof(word))
+	{
+		memcpy(&word, data + i, sizeof(word));
+		hash ^= word;
+		hash *= 1099511628211ULL;
+	}
+
+	for (; i < len; i++)
+	{
+		hash ^= (unsigned char) data[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+// One 64 byte block of SHA-256 into state
+void digestBlock(uint32_t *state, const unsigned char *block)
+{
+	static const uint32_t rounds[64] =
+	{
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+	};
+	uint32_t w[64], v[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 |
+			(uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+			(ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ w[i - 15] >> 3) +
+			(ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ w[i - 2] >> 10);
+
+	memcpy(v, state, sizeof(v));
+
+	for (i = 0; i < 64; i++)
+	{
+		t1 = v[7] + (ROTR(v[4], 6) ^ ROTR(v[4], 11) ^ ROTR(v[4], 25)) +
+			((v[4] & v[5]) ^ (~v[4] & v[6])) + rounds[i] + w[i];
+		t2 = (ROTR(v[0], 2) ^ ROTR(v[0], 13) ^ ROTR(v[0], 22)) +
+			((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+
+		memmove(v + 1, v, 7 * sizeof(uint32_t));
+		v[4] += t1;
+		v[0] = t1 + t2;
+	}
+
+	for (i = 0; i < 8; i++)
+		state[i] += v[i];
+}
+
+void startDigest(digester_t *d)
+{
+	static const uint32_t initial[8] =
+	{
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(d->state, initial, sizeof(initial));
+	d->len = 0;
+}
+
+// Take len more bytes at data
+void digestOn(digester_t *d, const void *data, size_t len)
+{
+	const unsigned char *at = data;
+	size_t used = d->len % 64, n;
+
+	d->len += len;
+
+	// Top up a block left part full
+	if (used)
+	{
+		n = len < 64 - used ? len : 64 - used;
+		memcpy(d->block + used, at, n);
+		at += n;
+		len -= n;
+
+		if (used + n < 64)
+			return;
+
+		digestBlock(d->state, d->block);
+	}
+
+	for (; len >= 64; at += 64, len -= 64)
+		digestBlock(d->state, at);
+
+	memcpy(d->block, at, len);
+}
+
+void endDigest(digester_t *d, digest_t *digest)
+{
+	uint64_t bits = d->len * 8;
+	unsigned char pad[72] = { 0x80 };
+	size_t n = 64 + 56 - d->len % 64;
+	int i;
+
+	// 0x80, zeros up to 56 bytes into a block, the length in bits
+	if (n > 64)
+		n -= 64;
+
+	for (i = 0; i < 8; i++)
+		pad[n + i] = bits >> (56 - 8 * i);
+
+	digestOn(d, pad, n + 8);
+
+	for (i = 0; i < 32; i++)
+		digest->bytes[i] = d->state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+void digestOf(const void *data, size_t len, digest_t *digest)
+{
+	digester_t d;
+
+	startDigest(&d);
+	digestOn(&d, data, len);
+	endDigest(&d, digest);
+}
+
+// Append len bytes of data, padded up to the next int
+void putImage(image_t *img, const void *data, size_t len)
+{
+	size_t padded = (len + 3) & ~(size_t) 3;
+
+	if (img->len + padded > img->cap)
+	{
+		img->cap = img->cap ? img->cap : INIT_BUF;
+		while (img->len + padded > img->cap)
+			img->cap *= 2;
+
+		if (!(img->data = realloc(img->data, img->cap)))
+			DIE("%s", "Bad memory putImage\n");
+	}
+
+	memcpy(img->data + img->len, data, len);
+	memset(img->data + img->len + len, 0, padded - len);
+	img->len += padded;
+}
+
+void putInt(image_t *img, int value)
+{
+	putImage(img, &value, sizeof(int));
+}
+
+// A chunk of the template's text is saved as where it is in the text,
+// anything else (text that had a comment cut out) as itself
+void putChunks(image_t *img, template_t *tpl, node_t *chunks)
+{
+	node_t *node;
+	int count = 0;
+
+	for (node = chunks; node; node = node->next)
+		count++;
+
+	putInt(img, count);
+
+	for (node = chunks; node; node = node->next)
+	{
+		putInt(img, node->len);
+
+		if (node->buf == tpl->text)
+		{
+			putInt(img, SNAPSHOT_VIEW);
+			putInt(img, node->data - tpl->text->charAt);
+		}
+		else
+		{
+			putInt(img, 0);
+			putImage(img, node->data, node->len);
+		}
+	}
+}
+
+// Append the defined macros (the built-ins aside), counted in head
+void putMacros(macrolist_t *macros, image_t *img, imghead_t *head)
+{
+	template_t *tpl;
+	tpart_t *part;
+	int i;
+
+	memset(head, 0, sizeof(imghead_t));
+	memcpy(head->magic, SNAPSHOT_MAGIC, sizeof(head->magic));
+	head->version = SNAPSHOT_VERSION;
+
+	for (i = PROTECTED_MACROS; i < macros->index; i++)
+	{
+		if (!macros->arr[i]->defined)
+			continue;
+
+		tpl = macros->arr[i]->body;
+		head->count++;
+
+		putInt(img, macros->arr[i]->nameLen);
+		putImage(img, macros->arr[i]->name, macros->arr[i]->nameLen);
+		putInt(img, tpl->text->length);
+		putImage(img, tpl->text->charAt, tpl->text->length);
+
+		putInt(img, tpl->slotCount);
+		putImage(img, tpl->slots, tpl->slotCount * sizeof(int));
+		putChunks(img, tpl, tpl->chunks);
+
+		putInt(img, tpl->partCount);
+		for (part = tpl->parts; part < tpl->parts + tpl->partCount; part++)
+		{
+			putInt(img, part->from);
+			putInt(img, part->to);
+			putInt(img, part->fromSlots);
+			putInt(img, part->toSlots);
+			putChunks(img, tpl, part->chunks);
+		}
+	}
+}
+
+// Write the defined macros (the built-ins aside) to path
+void saveSnapshot(macrolist_t *macros, const char *path)
+{
+	image_t img = { NULL, 0, 0, 0 };
+	imghead_t head;
+	char *tmp;
+	int fd, failed;
+
+	putMacros(macros, &img, &head);
+
+	// Replace the old image only once the new one is complete
+	if (!(tmp = malloc(strlen(path) + 5)))
+	{
+		free(img.data);
+		DIE("%s", "Bad memory saveSnapshot\n");
+	}
+
+	sprintf(tmp, "%s.tmp", path);
+
+	failed = (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 ||
+		writeImage(fd, &head, &img) || rename(tmp, path);
+
+	free(tmp);
+	free(img.data);
+
+	if (failed)
+		DIE("%s%s%s", "Unable to write snapshot (", path, ")\n");
+}
+
+// The next len bytes of a mapped image (and the padding after them)
+char *getImage(image_t *img, size_t len)
+{
+	char *data = img->data + img->pos;
+	size_t padded = (len + 3) & ~(size_t) 3;
+
+	if (padded < len || padded > img->len - img->pos)
+		DIE("%s", "Bad snapshot (truncated)\n");
+
+	img->pos += padded;
+
+	return data;
+}
+
+int getInt(image_t *img)
+{
+	int value;
+
+	memcpy(&value, getImage(img, sizeof(int)), sizeof(int));
+
+	return value;
+}
+
+// Read chunks of tpl's onto the list at tail, which owns each as soon
+// as it is read (a bad image fails part of the way through)
+void getChunks(image_t *img, template_t *tpl, node_t **tail)
+{
+	char *data;
+	string_t *copy;
+	int count = getInt(img), len, offset;
+
+	while (count-- > 0)
+	{
+		len = getInt(img);
+
+		if (len <= 0)
+			DIE("%s", "Bad snapshot (chunk)\n");
+
+		if (getInt(img) == SNAPSHOT_VIEW)
+		{
+			offset = getInt(img);
+
+			if (offset < 0 || offset > tpl->text->length - len)
+				DIE("%s", "Bad snapshot (chunk)\n");
+
+			*tail = createNode(tpl->text, tpl->text->charAt + offset, len, NULL);
+		}
+		else
+		{
+			data = getImage(img, len);
+			copy = newString(len);
+			memcpy(copy->charAt, data, len);
+			*tail = createNode(copy, copy->charAt, len, NULL);
+			destroyString(copy);
+		}
+
+		// The image does not keep the flags
+		if (isValidArg(*tail))
+			(*tail)->flags |= TOKEN_BALANCED;
+
+		if (!memchr((*tail)->data, ESCAPE, len))
+			(*tail)->flags |= TOKEN_UNESCAPED;
+		tail = &(*tail)->next;
+	}
+}
+
+// Map the image at path and check it was written whole, by this version
+image_t *mapSnapshot(const char *path)
+{
+	image_t *img;
+	imghead_t *head;
+	struct stat st;
+	char *why = NULL;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st))
+	{
+		if (fd >= 0)
+			close(fd);
+
+		DIE("%s%s%s", "Unable to open snapshot (", path, ")\n");
+	}
+
+	if ((size_t) st.st_size < sizeof(imghead_t))
+	{
+		close(fd);
+		DIE("%s", "Bad snapshot (truncated)\n");
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		DIE("%s%s%s", "Unable to map snapshot (", path, ")\n");
+
+	head = map;
+
+	if (memcmp(head->magic, SNAPSHOT_MAGIC, sizeof(head->magic)))
+		why = "not a snapshot";
+	else if (head->version != SNAPSHOT_VERSION)
+		why = "written by another version";
+	else if (head->size != st.st_size - sizeof(imghead_t))
+		why = "truncated";
+	else if (head->checksum != hashImage((char *) map + sizeof(imghead_t), head->size))
+		why = "checksum";
+
+	if (why || !(img = calloc(1, sizeof(image_t))))
+	{
+		munmap(map, st.st_size);
+
+		if (!why)
+			DIE("%s", "Bad memory mapSnapshot\n");
+
+		DIE("%s%s%s", "Bad snapshot (", why, ")\n");
+	}
+
+	img->data = (char *) map + sizeof(imghead_t);
+	img->len = head->size;
+	img->cap = st.st_size;
+
+	return img;
+}
+
+// Define the macros of a mapped image in macros. The image is shared
+// (by every context it is loaded into), it is read with a cursor of
+// our own.
+void loadSnapshot(macrolist_t *macros, image_t *image)
+{
+	imghead_t *head = (imghead_t *) (image->data - sizeof(imghead_t));
+	image_t cursor = *image, *img = &cursor;
+	template_t *tpl;
+	tpart_t *part;
+	macro_t *macro;
+	char *name;
+	uint32_t i;
+	int len, k, count;
+
+	img->pos = 0;
+
+	for (i = 0; i < head->count; i++)
+	{
+		len = getInt(img);
+		name = getImage(img, len);
+
+		for (k = 0; k < len && isalnum(name[k]); k++)
+			;
+
+		if (len <= 0 || k < len)
+			DIE("%s", "Bad snapshot (name)\n");
+
+		k = internMacro(macros, name, len);
+		macro = macros->arr[k];
+
+		if (macro->defined)
+			DIE("%s", "Macro already defined\n");
+
+		if (!(tpl = calloc(1, sizeof(template_t))))
+			DIE("%s", "Bad memory loadSnapshot\n");
+
+		// Defined right away, so the table owns whatever is read
+		macro->body = tpl;
+		macro->defined = 1;
+		macros->size++;
+		macros->generation++;
+
+		if ((len = getInt(img)) < 0)
+			DIE("%s", "Bad snapshot (value)\n");
+
+		tpl->text = newString(len);
+		memcpy(tpl->text->charAt, getImage(img, len), len);
+
+		tpl->slotCount = getInt(img);
+		if (tpl->slotCount < 0 || tpl->slotCount > len)
+			DIE("%s", "Bad snapshot (slots)\n");
+
+		if (!(tpl->slots = malloc((tpl->slotCount + 1) * sizeof(int))))
+			DIE("%s", "Bad memory loadSnapshot\n");
+
+		memcpy(tpl->slots, getImage(img, tpl->slotCount * sizeof(int)), tpl->slotCount * sizeof(int));
+
+		for (k = 0; k < tpl->slotCount; k++)
+			if (tpl->slots[k] < (k ? tpl->slots[k - 1] + 1 : 0) || tpl->slots[k] >= len ||
+				tpl->text->charAt[tpl->slots[k]] != ARGUMENT)
+				DIE("%s", "Bad snapshot (slots)\n");
+
+		getChunks(img, tpl, &tpl->chunks);
+
+		count = getInt(img);
+		if (count < 0 || count > tpl->slotCount)
+			DIE("%s", "Bad snapshot (parts)\n");
+
+		if (tpl->slotCount && !(tpl->parts = calloc(tpl->slotCount, sizeof(tpart_t))))
+			DIE("%s", "Bad memory loadSnapshot\n");
+
+		tpl->partCount = count;
+
+		for (part = tpl->parts; part < tpl->parts + tpl->partCount; part++)
+		{
+			part->from = getInt(img);
+			part->to = getInt(img);
+			part->fromSlots = getInt(img);
+			part->toSlots = getInt(img);
+			getChunks(img, tpl, &part->chunks);
+
+			if (part->from < 0 || part->from > len || part->to < -1 || part->to > len ||
+				part->fromSlots < 0 || part->toSlots < part->fromSlots || part->toSlots > tpl->slotCount)
+				DIE("%s", "Bad snapshot (parts)\n");
+		}
+	}
+}
+
+image_t *unmapSnapshot(image_t *img)
+{
+	if (!img)
+		return NULL;
+
+	munmap(img->data - sizeof(imghead_t), img->cap);
+	free(img);
+
+	return NULL;
+}
+
+// An image of the defined macros in memory, laid out as a mapped one
+// (its header in front), to be loaded the same way. Not checksummed,
+// it is never written out.
+image_t *imageMacros(macrolist_t *macros)
+{
+	image_t *img = calloc(1, sizeof(image_t));
+	imghead_t head;
+
+	if (!img)
+		DIE("%s", "Bad memory imageMacros\n");
+
+	memset(&head, 0, sizeof(head));
+	putImage(img, &head, sizeof(head));
+	putMacros(macros, img, &head);
+
+	memcpy(img->data, &head, sizeof(head));
+	img->data += sizeof(head);
+	img->len -= sizeof(head);
+
+	return img;
+}
+
+image_t *freeImage(image_t *img)
+{
+	if (!img)
+		return NULL;
+
+	free(img->data - sizeof(imghead_t));
+	free(img);
+
+	return NULL;
+}
+
+// Write an image (its header first) to fd, and close it
+int writeImage(int fd, imghead_t *head, image_t *img)
+{
+	head->size = img->len;
+	head->checksum = hashImage(img->data, img->len);
+
+	if (write(fd, head, sizeof(imghead_t)) != sizeof(imghead_t) ||
+		(img->len && write(fd, img->data, img->len) != (ssize_t) img->len))
+	{
+		close(fd);
+		return -1;
+	}
+
+	return close(fd);
+}
+
+// Where the output cache in dir keeps the file for hash
+char *cachePath(const char *dir, const digest_t *hash, const char *suffix)
+{
+	char *path = malloc(strlen(dir) + CACHE_NAME + 1), *at;
+	int i;
+
+	if (!path)
+		DIE("%s", "Bad memory cachePath\n");
+
+	at = path + sprintf(path, "%s/", dir);
+
+	for (i = 0; i < DIGEST_SIZE; i++)
+		at += sprintf(at, "%02x", hash->bytes[i]);
+
+	strcpy(at, suffix);
+
+	return path;
+}
+
+// Map the regular file at path (NULL if it is empty) and, with touch,
+// mark it used now. -1 if it can't be had.
+int mapRegular(const char *path, char **map, size_t *size, int touch)
+{
+	struct stat st;
+	int fd;
+
+	*map = NULL;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+		(st.st_size && (*map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+	{
+		*map = NULL;
+		close(fd);
+		return -1;
+	}
+
+	if (touch)
+		futimens(fd, NULL);
+
+	close(fd);
+	*size = st.st_size;
+
+	return 0;
+}
+
+int hashFile(const char *path, digest_t *hash)
+{
+	size_t size;
+	char *map;
+
+	if (mapRegular(path, &map, &size, 0))
+		return -1;
+
+	digestOf(map ? map : "", size, hash);
+
+	if (map)
+		munmap(map, size);
+
+	return 0;
+}
+
+// What the output cache keeps a document made of files under: the
+// digest of the cache's versions and of their contents' digests. 0 if
+// one of them is not a regular file (the document is not cached then).
+int cacheKey(char **files, int count, digest_t *key)
+{
+	uint32_t versions[2] = { CACHE_VERSION, CACHE_SEMANTICS };
+	digest_t hash;
+	digester_t d;
+	int i;
+
+	startDigest(&d);
+	digestOn(&d, versions, sizeof(versions));
+
+	for (i = 0; i < count; i++)
+	{
+		if (hashFile(files[i], &hash))
+			return 0;
+
+		digestOn(&d, &hash, sizeof(hash));
+	}
+
+	endDigest(&d, key);
+
+	return 1;
+}
+
+// The dependency on name as a macro, or as a file with kind DEP_FILE
+dep_t *findDep(deps_t *deps, int kind, const char *name, int len, unsigned int hash)
+{
+	int mask = deps->tableSize - 1, i, index;
+	dep_t *dep;
+
+	if (!deps->tableSize)
+		return NULL;
+
+	for (i = hash & mask; (index = deps->slots[i]) != EMPTY_SLOT; i = (i + 1) & mask)
+	{
+		dep = deps->arr + index;
+		if (dep->hash == hash && (dep->kind == DEP_FILE) == (kind == DEP_FILE) &&
+			dep->nameLen == len && !memcmp(dep->name, name, len))
+			return dep;
+	}
+
+	return NULL;
+}
+
+unsigned int depHash(void *table, int id)
+{
+	return ((deps_t *) table)->arr[id].hash;
+}
+
+void addDep(deps_t *deps, int kind, const char *name, int len, const digest_t *content)
+{
+	dep_t *dep;
+
+	if (deps->count == deps->capacity)
+	{
+		deps->capacity = deps->capacity ? deps->capacity * 2 : INIT_DEPS;
+		if (!(deps->arr = realloc(deps->arr, deps->capacity * sizeof(dep_t))))
+			DIE("%s", "Bad memory addDep\n");
+	}
+
+	dep = deps->arr + deps->count;
+	dep->kind = kind;
+	dep->name = arenaAlloc(&deps->names, len + 1);
+	memcpy(dep->name, name, len);
+	dep->name[len] = '\0';
+	dep->nameLen = len;
+	dep->hash = hashName(name, len) + (kind == DEP_FILE);
+
+	if (content)
+		dep->content = *content;
+	else memset(&dep->content, 0, sizeof(digest_t));
+
+	putSlot(&deps->slots, &deps->tableSize, deps->count, dep->hash, depHash, deps);
+	deps->count++;
+}
+
+// A lookup of name (id, NOT_FOUND if never interned), counted if it is
+// the first. Ids already counted skip hashing the name.
+void depMacro(deps_t *deps, macrolist_t *macros, const char *name, int len, int id)
+{
+	template_t *tpl;
+	digest_t content;
+
+	if (id != NOT_FOUND && id < deps->seenCount && deps->seen[id])
+		return;
+
+	if (!findDep(deps, DEP_DEFINED, name, len, hashName(name, len)))
+	{
+		if (id == NOT_FOUND || !macros->arr[id]->defined)
+			addDep(deps, DEP_UNDEFINED, name, len, NULL);
+		else
+		{
+			tpl = macros->arr[id]->body;
+			digestOf(tpl->text->charAt, tpl->text->length, &content);
+			addDep(deps, DEP_DEFINED, name, len, &content);
+		}
+	}
+
+	if (id == NOT_FOUND)
+		return;
+
+	if (id >= deps->seenCount)
+	{
+		if (!(deps->seen = realloc(deps->seen, macros->capacity)))
+			DIE("%s", "Bad memory depMacro\n");
+
+		memset(deps->seen + deps->seenCount, 0, macros->capacity - deps->seenCount);
+		deps->seenCount = macros->capacity;
+	}
+
+	deps->seen[id] = 1;
+}
+
+// An \include of file by name. Its contents are digested once per read.
+void depFile(deps_t *deps, incfile_t *file, const char *name)
+{
+	int len = strlen(name);
+
+	if (findDep(deps, DEP_FILE, name, len, hashName(name, len) + 1))
+		return;
+
+	if (!file->hashed)
+	{
+		digestOf(file->text->charAt, file->text->length, &file->content);
+		file->hashed = 1;
+	}
+
+	addDep(deps, DEP_FILE, name, len, &file->content);
+}
+
+// Whether a dependency a manifest lists is still what it was
+int depHolds(macrolist_t *macros, int kind, const char *name, int len, const digest_t *content)
+{
+	template_t *tpl;
+	digest_t hash;
+	int id;
+
+	if (kind == DEP_FILE)
+		return !hashFile(name, &hash) && !memcmp(&hash, content, sizeof(digest_t));
+
+	id = lookupMacro(macros, name, len);
+
+	if (id == NOT_FOUND || !macros->arr[id]->defined)
+		return kind == DEP_UNDEFINED;
+
+	tpl = macros->arr[id]->body;
+
+	if (kind != DEP_DEFINED)
+		return 0;
+
+	digestOf(tpl->text->charAt, tpl->text->length, &hash);
+
+	return !memcmp(&hash, content, sizeof(digest_t));
+}
+
+// Whether the manifest of size bytes at map is whole and everything it
+// lists is still what it was. If so, the digest and length of the output.
+int readManifest(macrolist_t *macros, char *map, size_t size, digest_t *hash, uint64_t *bytes)
+{
+	imghead_t *head = (imghead_t *) map;
+	image_t img = { NULL, 0, 0, 0 };
+	digest_t content;
+	uint32_t i;
+	char *name;
+	int kind, len;
+
+	if (size < sizeof(imghead_t) || memcmp(head->magic, CACHE_MAGIC, sizeof(head->magic)) ||
+		head->version != CACHE_VERSION || head->size != size - sizeof(imghead_t) ||
+		head->checksum != hashImage(map + sizeof(imghead_t), head->size))
+		return 0;
+
+	img.data = map + sizeof(imghead_t);
+	img.len = head->size;
+	memcpy(hash, getImage(&img, sizeof(digest_t)), sizeof(digest_t));
+	memcpy(bytes, getImage(&img, sizeof(uint64_t)), sizeof(uint64_t));
+
+	for (i = 0; i < head->count; i++)
+	{
+		kind = getInt(&img);
+		len = getInt(&img);
+		name = getImage(&img, len + 1);
+		memcpy(&content, getImage(&img, sizeof(content)), sizeof(content));
+
+		if (!depHolds(macros, kind, name, len, &content))
+			return 0;
+	}
+
+	return 1;
+}
+
+// Write out the output the cache keeps under key, if everything its
+// manifest lists is still what it was. 0 (and nothing written) if not.
+int replayCache(proj1_t *ctx, const digest_t *key, proj1_write_t write, void *user)
+{
+	char *path = cachePath(ctx->cacheDir, key, ".dep"), *map;
+	struct iovec iov[PROJ1_IOV];
+	uint64_t bytes;
+	digest_t hash;
+	size_t size, done = 0;
+	int hit, count;
+
+	if ((hit = !mapRegular(path, &map, &size, 1)))
+	{
+		hit = readManifest(ctx->macros, map, size, &hash, &bytes);
+
+		if (map)
+			munmap(map, size);
+	}
+
+	free(path);
+
+	if (!hit)
+		return 0;
+
+	// The output may have been trimmed since
+	path = cachePath(ctx->cacheDir, &hash, ".out");
+	hit = !mapRegular(path, &map, &size, 1);
+	free(path);
+
+	if (!hit || size != bytes)
+	{
+		if (map)
+			munmap(map, size);
+
+		return 0;
+	}
+
+	while (done < size)
+	{
+		for (count = 0; count < PROJ1_IOV && done < size; count++)
+		{
+			iov[count].iov_base = map + done;
+			iov[count].iov_len = size - done < SINK_BUF ? size - done : SINK_BUF;
+			done += iov[count].iov_len;
+		}
+
+		if (write(user, iov, count))
+		{
+			munmap(map, size);
+			WARN("%s", "Unable to write output\n");
+			fail(PROJ1_OUTPUT);
+		}
+	}
+
+	if (map)
+		munmap(map, size);
+
+	if (trace.emit)
+		traceSpan("call", "cached document", trace.callStart, nowNs(), "\"bytes\": %ld", (long) size);
+
+	return 1;
+}
+
+// Start keeping what a document depends on, and a copy of its output
+// in dir (without one, just what it depends on). NULL if there is
+// nowhere in dir to copy it to.
+deps_t *createDeps(const char *dir, const digest_t *key, proj1_write_t write, void *user)
+{
+	deps_t *deps = calloc(1, sizeof(deps_t));
+
+	if (!deps || (dir && !(deps->tmp = malloc(strlen(dir) + sizeof("/.tmp-XXXXXX")))))
+		DIE("%s", "Bad memory createDeps\n");
+
+	deps->fd = -1;
+
+	if (!dir)
+		return deps;
+
+	sprintf(deps->tmp, "%s/.tmp-XXXXXX", dir);
+	deps->dir = dir;
+	deps->key = *key;
+	deps->write = write;
+	deps->user = user;
+
+	if ((deps->fd = mkstemp(deps->tmp)) < 0)
+	{
+		free(deps->tmp);
+		free(deps);
+		WARN("%s%s%s", "Unable to write to the cache (", dir, ")\n");
+
+		return NULL;
+	}
+
+	return deps;
+}
+
+// All of iov to fd
+int writeIov(int fd, const struct iovec *iov, int count)
+{
+	struct iovec left[PROJ1_IOV], *at = left;
+	ssize_t n;
+
+	memcpy(left, iov, count * sizeof(struct iovec));
+
+	while (count > 0)
+	{
+		if ((n = writev(fd, at, count)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		for (; count > 0 && (size_t) n >= at->iov_len; at++, count--)
+			n -= at->iov_len;
+
+		if (count > 0)
+		{
+			at->iov_base = (char *) at->iov_base + n;
+			at->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+// The sink's write while a document is expanded for the cache: the
+// output goes to the caller and to the file it is to be kept in
+int cacheWrite(void *user, const struct iovec *iov, int count)
+{
+	deps_t *deps = user;
+
+	if (deps->fd >= 0 && writeIov(deps->fd, iov, count))
+	{
+		close(deps->fd);
+		deps->fd = -1;
+	}
+
+	return deps->write(deps->user, iov, count);
+}
+
+// Keep the output of a document that expanded under its own digest, and
+// its manifest (that digest and what it depended on) under its key. A
+// document that warned is not kept. -1 if it could not be kept.
+int storeCache(deps_t *deps)
+{
+	image_t img = { NULL, 0, 0, 0 };
+	imghead_t head;
+	uint64_t bytes = 0;
+	digest_t hash;
+	digester_t d;
+	char *buf, *path;
+	dep_t *dep;
+	int fd = deps->fd, failed;
+	ssize_t n;
+
+	if (deps->warned)
+		return 0;
+
+	if (fd < 0)
+		return -1;
+
+	deps->fd = -1;
+
+	// Read back a block at a time (a whole output mapped would double
+	// what a large document takes)
+	buf = arenaAlloc(&scratch, SINK_BUF);
+	startDigest(&d);
+
+	while ((n = pread(fd, buf, SINK_BUF, bytes)) > 0)
+	{
+		digestOn(&d, buf, n);
+		bytes += n;
+	}
+
+	endDigest(&d, &hash);
+	path = cachePath(deps->dir, &hash, ".out");
+	failed = close(fd) || n < 0 || rename(deps->tmp, path);
+	free(path);
+
+	if (failed)
+		return -1;
+
+	// The output is in place (the tmp name is free again), then the
+	// manifest, written to a tmp of its own
+	sprintf(deps->tmp, "%s/.tmp-XXXXXX", deps->dir);
+
+	putImage(&img, &hash, sizeof(hash));
+	putImage(&img, &bytes, sizeof(bytes));
+
+	for (dep = deps->arr; dep < deps->arr + deps->count; dep++)
+	{
+		putInt(&img, dep->kind);
+		putInt(&img, dep->nameLen);
+		putImage(&img, dep->name, dep->nameLen + 1);
+		putImage(&img, &dep->content, sizeof(dep->content));
+	}
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, CACHE_MAGIC, sizeof(head.magic));
+	head.version = CACHE_VERSION;
+	head.count = deps->count;
+
+	path = cachePath(deps->dir, &deps->key, ".dep");
+
+	if ((fd = mkstemp(deps->tmp)) < 0 || writeImage(fd, &head, &img) || rename(deps->tmp, path))
+		failed = 1;
+	else
+	{
+		free(deps->tmp);
+		deps->tmp = NULL;
+	}
+
+	free(path);
+	free(img.data);
+
+	return failed ? -1 : 0;
+}
+
+// A document's dependencies, and its output unless it was kept
+deps_t *destroyDeps(deps_t *deps)
+{
+	if (!deps)
+		return NULL;
+
+	if (deps->fd >= 0)
+		close(deps->fd);
+
+	if (deps->tmp)
+		unlink(deps->tmp);
+
+	destroyArena(&deps->names);
+	free(deps->tmp);
+	free(deps->arr);
+	free(deps->slots);
+	free(deps->seen);
+	free(deps);
+
+	return NULL;
+}
+
+// Whether name is one cachePath gives: a digest and .out or .dep
+int isCacheName(const char *name)
+{
+	return strspn(name, "0123456789abcdef") == CACHE_NAME - 5 &&
+		(!strcmp(name + CACHE_NAME - 5, ".out") || !strcmp(name + CACHE_NAME - 5, ".dep"));
+}
+
+// Least recently used first
+int compareUsed(const void *a, const void *b)
+{
+	const cachefile_t *x = a, *y = b;
+
+	if (x->used.tv_sec != y->used.tv_sec)
+		return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+
+	if (x->used.tv_nsec != y->used.tv_nsec)
+		return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+
+	return strcmp(x->name, y->name);
+}
+
+// Remove the least recently used of the cache's files until the rest
+// take at most maxBytes. Nothing else in dir is looked at.
+void trimCache(const char *dir, long maxBytes)
+{
+	cachefile_t *files = NULL;
+	struct dirent *entry;
+	struct stat st;
+	long total = 0;
+	int count = 0, capacity = 0, i;
+	DIR *d;
+
+	if (!(d = opendir(dir)))
+		DIE("%s%s%s", "Unable to read the cache (", dir, ")\n");
+
+	while ((entry = readdir(d)))
+	{
+		if (!isCacheName(entry->d_name) || fstatat(dirfd(d), entry->d_name, &st, 0) ||
+			!S_ISREG(st.st_mode))
+			continue;
+
+		if (count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : INIT_DEPS;
+			if (!(files = realloc(files, capacity * sizeof(cachefile_t))))
+			{
+				closedir(d);
+				DIE("%s", "Bad memory trimCache\n");
+			}
+		}
+
+		strcpy(files[count].name, entry->d_name);
+		files[count].size = st.st_size;
+		files[count].used = st.st_mtim;
+		total += st.st_size;
+		count++;
+	}
+
+	if (total > maxBytes)
+		qsort(files, count, sizeof(cachefile_t), compareUsed);
+
+	for (i = 0; i < count && total > maxBytes; i++)
+		if (!unlinkat(dirfd(d), files[i].name, 0))
+			total -= files[i].size;
+
+	closedir(d);
+	free(files);
+}
+
+// Cut the len bytes at c into segments of at least size bytes (the last
+// aside), each ending just after a newline at the top level, found the
+// way lexChunks finds it (a comment runs over the newlines it ends
+// with), so chunking can start over there. Returns how many.
+int splitSegments(const char *c, int len, int size, segment_t **segments)
+{
+	segment_t *arr = calloc(len / size + 1, sizeof(segment_t));
+	int count = 0, braces = 0, start = 0, i;
+
+	if (!arr)
+		DIE("%s", "Bad memory splitSegments\n");
+
+	for (i = 0; i < len; i++)
+	{
+		switch (c[i])
+		{
+			case COMMENT_START:
+				do
+				{
+					while (++i < len && c[i] != NEW_LINE)
+						;
+
+					while (++i < len && (charClass[(unsigned char) c[i]] & CLASS_SPACE))
+						;
+				} while (i < len && c[i] == COMMENT_START);
+
+				i--;
+				break;
+
+			case BRACE_OPEN:
+				braces++;
+				break;
+
+			case BRACE_CLOSE:
+				braces--;
+				break;
+
+			case ESCAPE:
+				if (i + 1 < len && isSpecialCharacter(c[i + 1]))
+					i++;
+				break;
+
+			case NEW_LINE:
+				if (!braces && i + 1 - start >= size)
+				{
+					arr[count].start = start;
+					arr[count++].end = start = i + 1;
+				}
+				break;
+
+			default:
+				i += skipLiteral(c + i + 1, len - i - 1);
+				break;
+		}
+	}
+
+	if (start < len)
+	{
+		arr[count].start = start;
+		arr[count++].end = len;
+	}
+
+	*segments = arr;
+
+	return count;
+}
+
+// The sink's write for a segment expanded ahead: into its buffer.
+// Output too large for one gives up, the segment is expanded in place.
+int keepOutput(void *user, const struct iovec *iov, int count)
+{
+	segment_t *seg = user;
+	size_t cap;
+	char *out;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (seg->len + iov[i].iov_len >= (size_t) seg->cap)
+		{
+			for (cap = seg->cap ? seg->cap : INIT_BUF; cap <= seg->len + iov[i].iov_len; cap *= 2)
+				;
+
+			if (cap > INT_MAX || !(out = realloc(seg->out, cap)))
+				return -1;
+
+			seg->out = out;
+			seg->cap = cap;
+		}
+
+		memcpy(seg->out + seg->len, iov[i].iov_base, iov[i].iov_len);
+		seg->len += iov[i].iov_len;
+		seg->out[seg->len] = '\0';
+	}
+
+	return 0;
+}
+
+// Expand seg on its own in a clone of base (the table as the wave
+// started), keeping its output, its first lookups and what it left the
+// names it looked up as. seg->deps stays NULL if it failed or warned.
+void speculate(proj1_t *base, wave_t *wave, segment_t *seg)
+{
+	proj1_t *ctx = proj1Clone(base);
+	jmp_buf failed;
+	string_t *str;
+	redef_t *redef;
+	deps_t *deps;
+	dep_t *dep;
+	int id;
+
+	if (!ctx)
+		return;
+
+	if (setjmp(failed))
+	{
+		leave(ctx, PROJ1_ERROR);
+		proj1Destroy(ctx);
+		return;
+	}
+
+	enter(ctx, &failed);
+	deps = ctx->doc.deps = createDeps(NULL, NULL, NULL, NULL);
+
+	// A header of its own, the brace index is this thread's
+	str = poolAlloc(&stringPool);
+	str->charAt = (char *) wave->text + seg->start;
+	str->length = seg->end - seg->start;
+	str->refs = 0;
+	str->storage = STORE_CALLER;
+	str->braces = NULL;
+
+	ctx->doc.stack = createStack();
+	chunkString(str, ctx->doc.stack);
+	destroyString(str);
+
+	ctx->doc.out = createSink(keepOutput, seg);
+	processChunks(ctx->doc.stack, ctx->macros, ctx->includes, ctx->doc.out);
+	flushSink(ctx->doc.out);
+
+	if (!deps->warned)
+	{
+		// A name is only defined or undefined after it is looked up
+		for (dep = deps->arr; dep < deps->arr + deps->count; dep++)
+		{
+			if (dep->kind == DEP_FILE || depHolds(ctx->macros, dep->kind, dep->name, dep->nameLen, &dep->content))
+				continue;
+
+			if (!seg->redefs && !(seg->redefs = malloc(deps->count * sizeof(redef_t))))
+				DIE("%s", "Bad memory speculate\n");
+
+			redef = seg->redefs + seg->redefCount++;
+			redef->name = dep->name;
+			redef->nameLen = dep->nameLen;
+			redef->value = NULL;
+
+			if ((id = lookupMacro(ctx->macros, dep->name, dep->nameLen)) != NOT_FOUND && ctx->macros->arr[id]->defined)
+			{
+				str = ctx->macros->arr[id]->body->text;
+
+				if (!(redef->value = malloc(str->length + 1)))
+					DIE("%s", "Bad memory speculate\n");
+
+				memcpy(redef->value, str->charAt, str->length + 1);
+			}
+		}
+
+		seg->deps = deps;
+		ctx->doc.deps = NULL;
+	}
+
+	leave(ctx, PROJ1_OK);
+	proj1Destroy(ctx);
+}
+
+// One of a wave's threads: segments of it, one at a time, each from a
+// table of the thread's own loaded from the wave's image
+void *speculateWave(void *arg)
+{
+	wave_t *wave = arg;
+	proj1_t *base = proj1Create();
+	int i;
+
+	if (base && proj1LoadSnapshot(base, wave->image))
+		base = proj1Destroy(base);
+
+	while (base)
+	{
+		pthread_mutex_lock(&wave->lock);
+		i = wave->next < wave->last ? wave->next++ : -1;
+		pthread_mutex_unlock(&wave->lock);
+
+		if (i < 0)
+			break;
+
+		speculate(base, wave, wave->segments + i);
+	}
+
+	proj1Destroy(base);
+
+	return NULL;
+}
+
+// Expand the wave's segments ahead on up to threads threads, this one
+// among them. A thread that can't be started leaves its share to the
+// others.
+void runWave(wave_t *wave, int threads)
+{
+	pthread_t tids[PARALLEL_MAX];
+	int started = 0, i;
+
+	wave->next = wave->first;
+
+	if (threads > wave->last - wave->first)
+		threads = wave->last - wave->first;
+
+	for (i = 1; i < threads; i++)
+		if (!pthread_create(tids + started, NULL, speculateWave, wave))
+			started++;
+
+	speculateWave(wave);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+}
+
+// Leave a name as a segment expanded ahead left it
+void redefine(macrolist_t *macros, redef_t *redef)
+{
+	macro_t *macro;
+	char *value = redef->value;
+	int id;
+
+	undef(macros, lookupMacro(macros, redef->name, redef->nameLen));
+
+	if (!value)
+		return;
+
+	// Interning may move arr
+	redef->value = NULL;
+	id = internMacro(macros, redef->name, redef->nameLen);
+	macro = macros->arr[id];
+	macro->body = compileTemplate(value);
+	macro->defined = 1;
+	macros->size++;
+	macros->generation++;
+}
+
+// Write out a segment expanded ahead and make its definitions, if what
+// it looked up is all still what it found. If not (or it failed or
+// warned on its own), expand it again, in place. 1 if that went on to
+// the end of the document.
+int commitSegment(proj1_t *ctx, string_t *doc, segment_t *seg)
+{
+	stack_t *s = ctx->doc.stack;
+	string_t *str;
+	node_t *node;
+	dep_t *dep;
+	int holds = seg->deps != NULL, i;
+
+	// The files it included were read for this call too
+	for (dep = holds ? seg->deps->arr : NULL; holds && dep < seg->deps->arr + seg->deps->count; dep++)
+		holds = dep->kind == DEP_FILE || depHolds(ctx->macros, dep->kind, dep->name, dep->nameLen, &dep->content);
+
+	if (!holds)
+	{
+		free(seg->out);
+		seg->out = NULL;
+
+		// With the rest of the document after it, as in one piece. Only
+		// a macro taking an argument from past the segment (and failing
+		// on the newline it ends with) reaches into the rest.
+		if (seg->end < doc->length)
+		{
+			push(s, doc, doc->charAt + seg->end, doc->length - seg->end);
+			s->head->kind = TOKEN_RANGE;
+			s->stop = s->head;
+		}
+
+		chunkRange(doc, seg->start, seg->end, s);
+		processChunks(s, ctx->macros, ctx->includes, ctx->doc.out);
+
+		if (!s->stop)
+			return 1;
+
+		destroyNode(pop(s));
+		s->stop = NULL;
+
+		return 0;
+	}
+
+	for (i = 0; i < seg->redefCount; i++)
+		redefine(ctx->macros, seg->redefs + i);
+
+	if (seg->len)
+	{
+		// Escaped already, written as it is (the chunk owns it)
+		str = takeString(seg->out, seg->len);
+		seg->out = NULL;
+
+		node = createNode(str, str->charAt, str->length, NULL);
+		node->flags = TOKEN_UNESCAPED;
+		destroyString(str);
+		writeChunk(ctx->doc.out, node, 0);
+	}
+
+	seg->deps = destroyDeps(seg->deps);
+
+	return 0;
+}
+
+wave_t *destroyWave(wave_t *wave)
+{
+	segment_t *seg;
+	int i;
+
+	if (!wave)
+		return NULL;
+
+	for (seg = wave->segments; seg < wave->segments + wave->count; seg++)
+	{
+		for (i = 0; i < seg->redefCount; i++)
+			free(seg->redefs[i].value);
+
+		free(seg->redefs);
+		free(seg->out);
+		destroyDeps(seg->deps);
+	}
+
+	free(wave->segments);
+	freeImage(wave->image);
+	pthread_mutex_destroy(&wave->lock);
+	free(wave);
+
+	return NULL;
+}
+
+// The rest of a call expanding a large mapped document on
+// ctx->parallel threads. Its segments are expanded ahead a wave at a
+// time, each on its own from the table as the wave started. Waves grow
+// from a single segment, so a header defining what the rest uses is
+// in the table before many segments are expanded ahead from it. Then,
+// in order, a segment whose lookups all still find what they did has
+// its output written and its definitions made, and any other is
+// expanded again here: the output is expand's, byte for byte.
+int expandParallel(proj1_t *ctx, proj1_write_t write, void *user)
+{
+	document_t *doc = &ctx->doc;
+	string_t *map = doc->src->map;
+	wave_t *wave;
+	int threads = ctx->parallel, size;
+
+	if (!(wave = doc->wave = calloc(1, sizeof(wave_t))))
+		DIE("%s", "Bad memory expandParallel\n");
+
+	pthread_mutex_init(&wave->lock, NULL);
+	wave->text = map->charAt;
+	wave->generation = -1;
+
+	ctx->includes->epoch++;
+	ctx->macros->documents++;
+
+	size = map->length / (threads * PARALLEL_SEGMENTS);
+	wave->count = splitSegments(map->charAt, map->length,
+		size > PARALLEL_SEGMENT ? size : PARALLEL_SEGMENT, &wave->segments);
+
+	doc->stack = createStack();
+	doc->out = createSink(write, user);
+
+	for (size = 1; wave->first < wave->count; size = size < threads ? size * 2 : 2 * threads)
+	{
+		wave->last = wave->count - wave->first > size ? wave->first + size : wave->count;
+
+		// An image only of a table that changed
+		if (wave->generation != ctx->macros->generation)
+		{
+			wave->image = freeImage(wave->image);
+			wave->image = imageMacros(ctx->macros);
+			wave->generation = ctx->macros->generation;
+		}
+
+		runWave(wave, threads);
+
+		while (wave->first < wave->last)
+		{
+			// The rest of the document went with it
+			if (commitSegment(ctx, map, wave->segments + wave->first++))
+				wave->first = wave->count;
+		}
 	}
-}
 
-long getFileLength(FILE *fp)
-{
-	int res;
+	flushSink(doc->out);
+
+	return leave(ctx, PROJ1_OK);
+}
 
-	// Reach EOF
-	fseek(fp, 0, SEEK_END);
 
-	// Save position indicator
-	res = ftell(fp);
-		
-	// Reset position indicator
-	fseek(fp, 0, SEEK_SET);
+// Resolve the vector scanner before any context can use it
+void pickScanner(void)
+{
+	skipLiteral("", 0);
+}
 
-	return res;
+// Make ctx the thread's context for a call: its allocators, its limits
+// and its counters, with DIE landing in failed. leave gives the thread
+// back what it had.
+void enter(proj1_t *ctx, jmp_buf *failed)
+{
+	state_t *saved = &ctx->saved;
+
+	saved->ctx = current;
+	saved->failJump = failJump;
+	saved->allocs.nodePool = nodePool;
+	saved->allocs.stringPool = stringPool;
+	saved->allocs.framePool = framePool;
+	saved->allocs.scratch = scratch;
+	saved->limits = limits;
+	saved->stats = stats;
+	saved->trace = trace;
+	saved->framing = framing;
+
+	current = ctx;
+	failJump = failed;
+	nodePool = ctx->allocs->nodePool;
+	stringPool = ctx->allocs->stringPool;
+	framePool = ctx->allocs->framePool;
+	scratch = ctx->allocs->scratch;
+	limits = ctx->limits;
+	limits.deadline = nowMs() + limits.timeMs;
+	stats = ctx->stats;
+	trace = ctx->trace;
+	framing = stats.enabled || trace.emit || limits.on;
+
+	if (trace.emit)
+		trace.callStart = nowNs();
+
+	ctx->mark = arenaMark(&scratch);
+	ctx->error[0] = '\0';
 }
 
-char *esc(char *str)
+// End a call with status, closing whatever document it was expanding.
+// Output not written by now (on a failure) is dropped.
+int leave(proj1_t *ctx, int status)
 {
-	char *escapedStr, *tmp;
-	int len = strlen(str);
-	int i, j, last;
+	state_t *saved = &ctx->saved;
+	char *end;
 
-	tmp = calloc(len + 1, sizeof(char));
-	for (i = j = 0; i < len; i++)
+	// Whatever was still going ends with the call
+	if (trace.emit)
 	{
-		if (str[i] == ESCAPE && i + 1 < len &&
-			!isSpecialCharacter(str[i + 1]) &&
-			!isPreservedCharacter(str[i + 1]))
-			tmp[j++] = str[(last = ++i)];
-		else 
-			tmp[j++] = str[i];
-	}
+		closeSpans(NULL);
 
-	// Save memory..
-	escapedStr = calloc(j + 1, sizeof(char));
-	for (i = 0; i < j; i++)
-		escapedStr[i] = tmp[i];
+		if (ctx->doc.out)
+			traceSpan("call", "document", trace.callStart, nowNs(), "\"status\": %d", status);
+	}
 
-	free(tmp);
-	return escapedStr;
+	if (ctx->doc.out)
+		ctx->doc.out->broken = 1;
+
+	closeDocument(&ctx->doc);
+	arenaRelease(&scratch, ctx->mark);
+
+	ctx->allocs->nodePool = nodePool;
+	ctx->allocs->stringPool = stringPool;
+	ctx->allocs->framePool = framePool;
+	ctx->allocs->scratch = scratch;
+	ctx->stats = stats;
+	ctx->trace = trace;
+
+	current = saved->ctx;
+	failJump = saved->failJump;
+	nodePool = saved->allocs.nodePool;
+	stringPool = saved->allocs.stringPool;
+	framePool = saved->allocs.framePool;
+	scratch = saved->allocs.scratch;
+	limits = saved->limits;
+	stats = saved->stats;
+	trace = saved->trace;
+	framing = saved->framing;
+
+	// proj1Error is the failure's message, as a string
+	if (status == PROJ1_OK)
+		ctx->error[0] = '\0';
+
+	for (end = ctx->error + strlen(ctx->error); end > ctx->error && end[-1] == NEW_LINE; )
+		*--end = '\0';
+
+	return status;
 }
 
-char *escAll(char *str)
+void closeDocument(document_t *doc)
 {
-	char *escapedStr, *tmp;
-	int len = strlen(str);
-	int i, j, last;
+	sink_t *nested;
 
-	tmp = calloc(len + 1, sizeof(char));
-	for (i = j = 0; i < len; i++)
+	// \expandafters a failure cut short
+	while ((nested = doc->nested))
 	{
-		if (str[i] == ESCAPE && i + 1 < len &&
-			!isPreservedCharacter(str[i + 1]))
-			tmp[j++] = str[(last = ++i)];
-		else 
-			tmp[j++] = str[i];
+		doc->nested = nested->outer;
+		destroySink(nested);
 	}
 
-	// Save memory..
-	escapedStr = calloc(j + 1, sizeof(char));
-	for (i = 0; i < j; i++)
-		escapedStr[i] = tmp[i];
-
-	free(tmp);
-	return escapedStr;
+	doc->out = destroySink(doc->out);
+	doc->stack = destroyStack(doc->stack);
+	doc->src = destroySource(doc->src);
+	doc->deps = destroyDeps(doc->deps);
+	doc->wave = destroyWave(doc->wave);
 }
 
-char *removeBraces(char *str)
+// The rest of a call expanding a document, once its stack (or source)
+// is set up
+int expand(proj1_t *ctx, proj1_write_t write, void *user)
 {
-	char *newStr;
-	int len, i, j;
+	document_t *doc = &ctx->doc;
+	long start = 0, flushStart = 0;
 
-	if (!str || !(len = strlen(str)))
-		return NULL;
+	// Files an earlier call included may have changed since
+	ctx->includes->epoch++;
+	ctx->macros->documents++;
 
-	newStr = calloc(len + 1, sizeof(char));
+	if (!doc->stack)
+		doc->stack = createStack();
 
-	i = (str[0] == BRACE_OPEN);
-	for (j = 0; i < len - 1; i++)
-		newStr[j++] = str[i];
+	doc->stack->src = doc->src;
+	doc->out = createSink(write, user);
 
-	if (str[i] != BRACE_CLOSE)
-		newStr[j] = str[i];
+	if (stats.enabled)
+		start = nowNs();
 
-	return newStr;
+	processChunks(doc->stack, ctx->macros, ctx->includes, doc->out);
+
+	// The last of the output counts too
+	if (stats.enabled)
+		flushStart = nowNs();
+
+	flushSink(doc->out);
+
+	if (stats.enabled)
+	{
+		stats.outputNs += nowNs() - flushStart;
+		stats.totalNs += nowNs() - start;
+	}
+
+	if (doc->deps && storeCache(doc->deps))
+		WARN("%s%s%s", "Unable to write to the cache (", ctx->cacheDir, ")\n");
+
+	return leave(ctx, PROJ1_OK);
 }
 
-void def(macrolist_t *macros, char *name, char *value)
+// The macro table (and include cache) of a new context: a clone's
+// starts out as its base's
+int fillContext(proj1_t *ctx)
 {
-	macro_t *newMacro;
-	macro_t **newArr;
-	int i, j;
+	jmp_buf failed;
+	int status;
 
-	// Expand (double size)
-	if (macros->index + 1 == macros->capacity || macros->size == macros->capacity)
-	{
-		newArr = calloc(macros->capacity * 2, sizeof(macro_t *));
+	if ((status = setjmp(failed)))
+		return leave(ctx, status);
 
-		// Get rid of holes
-		for (i = j = 0; i < macros->capacity; i++)
-			if (macros->arr[i])
-				newArr[j++] = macros->arr[i];
-		
-		// Cleanup
-		free(macros->arr);
+	enter(ctx, &failed);
 
-		macros->capacity = macros->capacity * 2;
-		macros->arr = newArr;
-		macros->index = j;
+	if (ctx->base)
+		ctx->macros = cloneMacros(ctx->base->macros);
+	else
+	{
+		ctx->macros = initMacros();
+		ctx->includes = createIncludes();
 	}
 
-	macros->arr[macros->index++] = createMacro(removeBraces(name), removeBraces(value));
-	macros->size++;
+	return leave(ctx, PROJ1_OK);
 }
 
-void undef(macrolist_t *macros, int index)
+proj1_t *proj1Create(void)
 {
-	if (!macros || index >= macros->capacity)
-		return;
-		
-	free(macros->arr[index]->name);
-	free(macros->arr[index]->value);
-	free(macros->arr[index]);
-	macros->arr[index] = NULL;
-	macros->size--;
-}
+	proj1_t *ctx = calloc(1, sizeof(proj1_t));
 
-string_t *replace(char *original, char *value)
-{
-	string_t *newStr = calloc(1, sizeof(string_t));
-	int valLen = strlen(value), i, j;
-	int originLen = strlen(original);
-	int totalLen = 0;
-		
-	for (i = totalLen = 0; i < originLen; i++)
+	pthread_once(&scannerOnce, pickScanner);
+
+	if (!ctx || !(ctx->allocs = calloc(1, sizeof(allocs_t))))
 	{
-		if (original[i] == ESCAPE)
-		{
-			if (isSpecialCharacter(original[i + 1])) 
-			{
-				i++;
-				continue;
-			}
-		}
-		else if (original[i] == ARGUMENT)
-			totalLen += valLen - 1;
+		free(ctx);
+		return NULL;
 	}
 
-	newStr->length = totalLen + i + 1;
-	newStr->charAt = calloc(newStr->length + 1, sizeof(char));
+	ctx->allocs->nodePool.size = sizeof(node_t);
+	ctx->allocs->stringPool.size = sizeof(string_t) + SMALL_STRING;
+	ctx->allocs->framePool.size = sizeof(frame_t);
 
-	for (i = j = 0; i < originLen; i++)
-	{
-		if (original[i] == ESCAPE)
-		{
-			newStr->charAt[j++] = original[i++];
+	return fillContext(ctx) ? proj1Destroy(ctx) : ctx;
+}
 
-			if (i < originLen)
-				newStr->charAt[j++] = original[i];
-		}
-		else if (original[i] == ARGUMENT)
-		{
-			strcat(newStr->charAt + j, value);
-			j += valLen;
-		}
-		else newStr->charAt[j++] = original[i];
+proj1_t *proj1Clone(proj1_t *base)
+{
+	proj1_t *ctx = calloc(1, sizeof(proj1_t));
+
+	if (!ctx)
+		return NULL;
+
+	ctx->base = base;
+	ctx->allocs = base->allocs;
+	ctx->includes = base->includes;
+	ctx->limits = base->limits;
+	ctx->report = base->report;
+	ctx->reportUser = base->reportUser;
+	ctx->trace.emit = base->trace.emit;
+	ctx->trace.user = base->trace.user;
+	ctx->trace.minNs = base->trace.minNs;
+
+	if (base->cacheDir && !(ctx->cacheDir = strdup(base->cacheDir)))
+	{
+		free(ctx);
+		return NULL;
 	}
 
-	return newStr;
+	return fillContext(ctx) ? proj1Destroy(ctx) : ctx;
 }
 
-void processChunks(stack_t *s, macrolist_t *macros, stack_t *out)
+proj1_t *proj1Destroy(proj1_t *ctx)
 {
-	int macroId, len, i;
-	char *filename, *temp1, *temp2;
-	string_t *arg1, *arg2, *before, *after;
-	stack_t *beforeStack, *afterStack, *beforeOut, *afterOut;
-
-	while (s->head)
-	{
-		macro_t *macro;
-		for (i = 0; i < macros->size; i++)
-		{
-			macro = macros->arr[i];
-			if (macro)
-			{
-				temp1 = macro->name;
-				temp2 = macro->value;
-			}
+	if (!ctx)
+		return NULL;
 
-			if (i >= PROTECTED_MACROS)
-			{
-				if (macro)
-				{
-					temp1 = macro->name;
-					temp2 = macro->value;
-				}
-			}
-		}
+	// Nothing here fails, but the chunks go back to the pools
+	enter(ctx, NULL);
+	ctx->macros = destroyMacros(ctx->macros);
 
-		if (strlen(s->head->data) == 1)
-		{
-			if (s->head->data[0] == ESCAPE && s->head->next && isSpecialCharacter(s->head->next->data[0]))
-			{
-				len = 2 + strlen(s->head->next->data);
-				filename = calloc(len, sizeof(char));
+	if (!ctx->base)
+		ctx->includes = destroyIncludes(ctx->includes);
 
-				filename[0] = ESCAPE;
-				for (i = 1; i < len - 1; i++)
-					filename[i] = s->head->next->data[i - 1];
+	leave(ctx, PROJ1_OK);
 
-				free(pop(s));
-				free(pop(s));
+	if (!ctx->base)
+	{
+		destroyArena(&ctx->allocs->nodePool.arena);
+		destroyArena(&ctx->allocs->stringPool.arena);
+		destroyArena(&ctx->allocs->framePool.arena);
+		destroyArena(&ctx->allocs->scratch);
+		free(ctx->allocs);
+	}
 
-				push(s, filename);
-				free(filename);
-			}
+	free(ctx->stats.macros);
+	free(ctx->trace.open);
+	free(ctx->cacheDir);
+	free(ctx);
 
-			temp1 = pop(s);
-			push(out, temp1);
-			free(temp1);
+	return NULL;
+}
 
-			continue;
-		}
+void proj1SetLimits(proj1_t *ctx, const proj1_limits_t *set)
+{
+	memset(&ctx->limits, 0, sizeof(limits_t));
+	ctx->limits.expansions = set->expansions;
+	ctx->limits.stackBytes = set->stackBytes;
+	ctx->limits.includeDepth = set->includeDepth;
+	ctx->limits.timeMs = set->timeMs;
+	ctx->limits.on = set->expansions || set->stackBytes || set->includeDepth || set->timeMs;
+}
 
-		// (Else)
-		switch (s->head->data[0])
-		{
-			case ESCAPE:
-				if (isSpecialCharacter(s->head->data[1]) || isPreservedCharacter(s->head->data[1]))
-				{
-					temp1 = pop(s);
-					temp2 = esc(temp1);
-					push(out, temp2);
-					free(temp1);
-					free(temp2);
-				}
-				else
-				{
-					macroId = findMacro(s->head->data, macros);
-					switch (macroId)
-					{
-						case NOT_FOUND:
-							DIE("%s", "Invalid macro\n");
-							break;
-
-						case DEF:
-							if (!s->head->next || !s->head->next->next)
-							{
-								DIE("%s", "Missing argument(s) for def\n");
-							}
-
-							macroId = findMacro(s->head->next->data, macros);
-
-							if (macroId != NOT_FOUND)
-							{
-								DIE("%s", "Macro already defined\n");
-							}
-
-							if (!isValidDefArg(s->head->next->data) ||
-								!isValidArg(s->head->next->next->data))
-							{
-								DIE("%s", "Bad argument(s) for def\n");
-							}
-
-							if (!argIsAlnum(s->head->next->data))
-							{
-								DIE("%s", "New defenition requires alpha-numberic chars only\n");
-							}
-
-							def(macros, s->head->next->data, s->head->next->next->data);
-
-							free(pop(s));
-							free(pop(s));
-							free(pop(s));
-
-							break;
-
-						case UNDEF:
-							if (!s->head->next)
-							{
-								DIE("%s", "Missing argument(s) for def\n");
-							}
-
-							macroId = findMacro(s->head->next->data, macros);
-
-							if (macroId == NOT_FOUND)
-							{
-								DIE("%s", "Macro is not defined (can't undef)\n");
-							}
-
-							if (macroId < PROTECTED_MACROS)
-							{
-								DIE("%s", "Can't undef protected macros\n");
-							}
-
-							undef(macros, macroId);
-
-							free(pop(s));
-							free(pop(s));
-
-							break;
-
-						case IFDEF:
-							if (!s->head->next || !s->head->next->next ||
-								!s->head->next->next->next)
-							{
-								DIE("%s", "Missing argument(s) for if ifdef\n");
-							}
-
-							if (!isValidArg(s->head->next->data) ||
-								!isValidArg(s->head->next->next->data) || 
-								!isValidArg(s->head->next->next->next->data))
-							{
-								DIE("%s", "Bad argument(s) for ifdef\n");
-							}
-
-							if (findMacro(s->head->next->data, macros) == NOT_FOUND)
-								temp1 = removeBraces(s->head->next->next->next->data);
-							else temp1 = removeBraces(s->head->next->next->data);
-
-							arg1 = readString(temp1);
-							free(temp1);
-
-							// ifdef (DEF) (THEN) (ELSE)
-							free(pop(s));	 // ifdef
-							free(pop(s));	 // (DEF)
-							free(pop(s));	 // (THEN)
-							free(pop(s));	 // (ELSE)
-
-							chunkString(arg1, s);
-							destroyString(arg1);
-
-							break;
-
-						case IF:
-							if (!s->head->next || !s->head->next->next ||
-								!s->head->next->next->next)
-							{
-								DIE("%s", "Missing argument(s) for if\n");
-							}
-
-							if (!isValidArg(s->head->next->data) ||
-								!isValidArg(s->head->next->next->data) || 
-								!isValidArg(s->head->next->next->next->data))
-							{
-								DIE("%s", "Bad argument(s) for if\n");
-							}
-
-							if (strlen(s->head->next->data) < 3)
-								temp1 = removeBraces(s->head->next->next->next->data);
-							else temp1 = removeBraces(s->head->next->next->data);
-
-							arg1 = readString(temp1);
-							free(temp1);
-
-							// TODO: popn(s, 4);
-							free(pop(s));
-							free(pop(s));
-							free(pop(s));
-							free(pop(s));
-							
-							chunkString(arg1, s);
-							destroyString(arg1);
-							break;
-
-						case INCLUDE:
-							if (!s->head->next)
-							{
-								DIE("%s", "Missing argument(s) for if include\n");
-							}
-							
-							if (!isValidArg(s->head->next->data))
-							{
-								DIE("%s", "Bad argument(s) for include\n");
-							}
-
-							filename = removeBraces(s->head->next->data);
-							
-							free(pop(s));
-							free(pop(s));
-							
-							arg1 = readFile(filename);
-							free(filename);
-							chunkString(arg1, s);
-							destroyString(arg1);
-							break;
-
-						case EXPANDAFTER:
-							if (!s->head->next || !s->head->next->next)
-							{
-								DIE("%s", "Missing argument(s) for expandafter\n");
-							}
-
-							if (!isValidArg(s->head->next->data) ||
-								!isValidArg(s->head->next->next->data))
-							{
-								DIE("%s", "Bad argument(s) for expandafter\n");
-							}
-
-							free(pop(s));
-
-							// After
-							temp1 = pop(s);
-							temp2 = removeBraces(temp1);
-							free(temp1);
-							after = readString(temp2);
-							free(temp2);
-
-							// Before
-							temp1 = pop(s);
-							temp2 = removeBraces(temp1);
-							free(temp1);
-							before = readString(temp2);
-							free(temp2);
-
-							beforeStack = createStack();
-							beforeOut = createStack();
-
-							chunkString(before, beforeStack);
-							processChunks(beforeStack, macros, beforeOut);
-
-							destroyStack(beforeStack);
-							beforeStack = createStack();
-							flipStack(beforeOut, beforeStack);
-
-							destroyString(before);
-							before = stackToString(beforeStack);
-
-							// Concat strings
-							if (before)
-							{
-								arg1 = calloc(1, sizeof(string_t));
-								arg1->length = before->length + after->length;
-								arg1->charAt = calloc(arg1->length + 1, sizeof(char));
-								
-								for (i = 0; i < after->length; i++)
-									arg1->charAt[i] = after->charAt[i];
-								
-								for (len = 0; len < before->length; len++)
-									arg1->charAt[i++] = before->charAt[len];
-							}
-							else arg1 = createString(after->charAt);
-
-							chunkString(arg1, s);
-							
-							// cleanup
-							destroyString(before);
-							destroyString(after);
-							destroyString(arg1);
-							destroyStack(beforeStack);
-							destroyStack(beforeOut);
-							break;
-						default:
-							if (!s->head->next)
-							{
-								DIE("%s", "Missing argument(s) for custom macro\n");
-							}
-							if (!isValidArg(s->head->next->data))
-							{
-								DIE("%s", "Bad argument(s) for custom macro\n");
-							}
-
-							temp1 = removeBraces(s->head->next->data);
-
-							arg1 = replace(macros->arr[macroId]->value, temp1);
-							free(temp1);
-							free(pop(s));
-							free(pop(s));
-							chunkString(arg1, s);
-							destroyString(arg1);
-							break;
-					}
-				}
-				break;
-			
-			case BRACE_OPEN:
-				temp1 = pop(s);
-				temp2 = removeBraces(temp1);
-				free(temp1);
+void proj1SetReport(proj1_t *ctx, proj1_report_t report, void *user)
+{
+	ctx->report = report;
+	ctx->reportUser = user;
+}
 
-				arg1 = createString(temp2);
-				free(temp2);
+void proj1SetStats(proj1_t *ctx, int enabled)
+{
+	ctx->stats.enabled = enabled != 0;
+}
 
-				push(s, BRACE_CLOSE_STR);
-				chunkString(arg1, s);
-				push(s, BRACE_OPEN_STR);
+void proj1SetTrace(proj1_t *ctx, proj1_trace_t trace, void *user, long minUs)
+{
+	ctx->trace.emit = trace;
+	ctx->trace.user = user;
+	ctx->trace.minNs = minUs * 1000;
+}
 
-				destroyString(arg1);
-				break;
+void proj1SetCache(proj1_t *ctx, const char *dir)
+{
+	free(ctx->cacheDir);
+	ctx->cacheDir = dir ? strdup(dir) : NULL;
+}
 
-			default:
-				temp1 = pop(s);
-				push(out, temp1);
-				free(temp1);
-				break;
-		}
-	}
+void proj1SetParallel(proj1_t *ctx, int threads)
+{
+	ctx->parallel = threads < PARALLEL_MAX ? threads : PARALLEL_MAX;
 }
 
-void chunkString(string_t *str, stack_t *s)
+int proj1ExpandBuffer(proj1_t *ctx, const char *data, size_t len, proj1_write_t write, void *user)
 {
-	// Capture from i to end
-	// when reaching %, brace, escape
-	int braces, chunkLen, i, commentLen, commentStart;
-	stack_t *tmpStack = createStack();
+	jmp_buf failed;
+	string_t *str;
+	int status;
 
-	// NOTE: i - commentLen - chunkLen
+	if ((status = setjmp(failed)))
+		return leave(ctx, status);
 
-	commentLen = braces = chunkLen = commentStart = 0;
-	for (i = 0; i <= str->length; i++)
-	{
-		switch (str->charAt[i])
-		{
-			case COMMENT_START:
-				// End chunk
-				if (chunkLen && !commentLen && !braces)
-				{
-					pushString(tmpStack, str->charAt, i - chunkLen, 0, 0, chunkLen);
-					chunkLen = 0;
-				}
+	enter(ctx, &failed);
 
-				// Init
-				commentLen = 0;
-				do
-				{
-					// Count '%' (COMMENT_START)
-					commentLen++;
-					
-					// Discard everything on this line
-					for (; ++i <= str->length && str->charAt[i] != NEW_LINE; commentLen++)
-						;
+	if (len > INT_MAX)
+		DIE("%s", "Document too large\n");
 
-					// Discard whitespace on next line
-					for (commentLen++; ++i <= str->length && isspace(str->charAt[i]); commentLen++)
-						;
+	// Chunked where it lies: nothing that outlives the call points
+	// into a document
+	str = poolAlloc(&stringPool);
+	str->charAt = (char *) data;
+	str->length = len;
+	str->refs = 0;
+	str->storage = STORE_CALLER;
+	str->braces = NULL;
 
-					// Preserve first non-whitespace character
-					--commentLen;
-				} while (i <= str->length && str->charAt[i--] == COMMENT_START);
+	ctx->doc.stack = createStack();
+	chunkString(str, ctx->doc.stack);
+	destroyString(str);
 
-				commentStart = i - commentLen++;
+	return expand(ctx, write, user);
+}
 
-				
-				if (!braces)
-					commentLen = 0;
-				// else commentLen++;
-				break;
-			
-			case BRACE_OPEN:
-				// There are no braces and there is a chunk
-				if (!braces && chunkLen)
-				{
-					pushString(tmpStack, str->charAt, i - chunkLen - commentLen,
-						commentStart, commentStart + commentLen, chunkLen);
-					
-					chunkLen = commentLen = commentStart = 0;
-				}
+int proj1ExpandStream(proj1_t *ctx, proj1_read_t read, void *readUser, proj1_write_t write, void *user)
+{
+	jmp_buf failed;
+	int status;
 
-				// Include in chunk
-				chunkLen++;
+	if ((status = setjmp(failed)))
+		return leave(ctx, status);
 
-				// Increment braces count
-				braces++;
-				break;
+	enter(ctx, &failed);
+	ctx->doc.src = createSource(NULL, 0, read, readUser);
 
-			case BRACE_CLOSE:
-				// Include in chunk
-				chunkLen++;
-				
-				// Close brace and check if chunk is closed too
-				if (!--braces)
-				{
-					pushString(tmpStack, str->charAt, i - chunkLen - commentLen + 1,
-						commentStart, commentStart + commentLen, chunkLen);
-					
-					chunkLen = commentLen = commentStart = 0;
-				}
-				break;
+	return expand(ctx, write, user);
+}
 
-			case NEW_LINE:
-				if (braces)
-					chunkLen++; // Include in chunk
-				else
-				{
-					if (chunkLen)
-					{
-						pushString(tmpStack, str->charAt, i - chunkLen - commentLen,
-							commentStart, commentStart + commentLen, chunkLen);
-						
-						chunkLen = commentLen = commentStart = 0;
-					}
-					push(tmpStack, "\n");
-				}
-				break;
-			
-			case ESCAPE:
-				// Check if has next character
-				if (i + 1 > str->length)
-				{
-					// TODO: invalid syntax
-					// Break out of loop..
-				}
+int proj1ExpandFiles(proj1_t *ctx, char **files, int count, proj1_write_t write, void *user)
+{
+	jmp_buf failed;
+	digest_t key;
+	int status;
 
-				// If next character is special character (%, {, }, \, #)
-				if (isSpecialCharacter(str->charAt[i + 1]))
-				{
-					i++;			// Skip processing next character
-					chunkLen++;	 // Include in chunk
-				}
+	if ((status = setjmp(failed)))
+		return leave(ctx, status);
 
-				else if (chunkLen && !braces)
-				{
-					pushString(tmpStack, str->charAt, i - chunkLen - commentLen,
-						commentStart, commentStart + commentLen, chunkLen);
-					
-					chunkLen = commentLen = commentStart = 0;
-				}
-				
-				// Include in chunk
-				chunkLen++;
-				break;
-				
-			default:
-				// Include in chunk
-				chunkLen++;
-				break;
-		}
-		// TODO: verify BRACES is not negative
-	}
+	enter(ctx, &failed);
 
-	if (chunkLen) // TODO: And validate braces/invalidc syntax for ESC char
+	// The limits have to see every step of an expansion
+	if (ctx->cacheDir && !limits.on && cacheKey(files, count, &key))
 	{
-		pushString(tmpStack, str->charAt, i - chunkLen - commentLen,
-			commentStart, commentStart + commentLen, chunkLen);
-	}
+		if (replayCache(ctx, &key, write, user))
+			return leave(ctx, PROJ1_OK);
 
-	flipStack(tmpStack, s);
-	destroyStack(tmpStack);
-}
-
-string_t *readFile(char *filename)
-{
-	FILE *fp;
-	string_t *str = calloc(1, sizeof(string_t));
-	int fLen;
-		
-	if (!(fp = fopen(filename, "r")))
-		DIE("%s%s%s", "Invalid initial file (", filename, ")\n");
+		ctx->doc.deps = createDeps(ctx->cacheDir, &key, write, user);
+	}
 
-	// Get the length of the file
-	fLen = getFileLength(fp);
+	ctx->doc.src = createSource(files, count, NULL, NULL);
 
-	// Allocate memory to save file into memory
-	str->length = fLen;
-	str->charAt = calloc(str->length + 1, sizeof(char));
+	if (ctx->doc.deps)
+		return expand(ctx, cacheWrite, ctx->doc.deps);
 
-	// Read contents of file into str
-	fread(str->charAt, sizeof(char), fLen, fp);
+	// One large file, with nothing that has to see every step of it
+	if (ctx->parallel > 1 && count == 1 && !framing && ctx->doc.src->map &&
+		ctx->doc.src->map->length >= 2 * PARALLEL_SEGMENT)
+		return expandParallel(ctx, write, user);
 
-	return str;
+	return expand(ctx, write, user);
 }
 
-string_t *readString(char *str)
+const char *proj1Error(proj1_t *ctx)
 {
-	return createString(str);
+	return ctx->error;
 }
 
-string_t *readStdin()
+int proj1PrintStats(proj1_t *ctx, FILE *fp, int json)
 {
-	int i, j, len;
-	char c, *tmp;
-	string_t *str = calloc(1, sizeof(string_t));
-	str->length = INIT_BUF;
-	str->charAt = calloc(str->length + 1, sizeof(char));
-		
-	// Read contents of file into str
-	for (i = 0; (c = fgetc(stdin)) != EOF; i++)
-	{
-		if (i == str->length)
-		{
-			str->length *= 2;
-			tmp = calloc(str->length + 1, sizeof(char));
+	jmp_buf failed;
+	int status;
 
-			for (j = 0; j < i; j++)
-				tmp[j] = str->charAt[j];
+	if ((status = setjmp(failed)))
+		return leave(ctx, status);
 
-			free(str->charAt);
-			str->charAt = tmp;
-		}
+	enter(ctx, &failed);
+	printStats(ctx->macros, ctx->includes, fp, json);
 
-		str->charAt[i] = c;
-	}
+	return leave(ctx, PROJ1_OK);
+}
 
-	len = strlen(str->charAt);
-	str->length = len;
-	tmp = calloc(len + 1, sizeof(char));
+int proj1TrimCache(proj1_t *ctx, long maxBytes)
+{
+	jmp_buf failed;
+	int status;
 
-	for (j = 0; j < len; j++)
-		tmp[j] = str->charAt[j];
+	if ((status = setjmp(failed)))
+		return leave(ctx, status);
 
-	free(str->charAt);
-	str->charAt = tmp;
+	enter(ctx, &failed);
 
-	return str;
+	if (ctx->cacheDir)
+		trimCache(ctx->cacheDir, maxBytes);
+
+	return leave(ctx, PROJ1_OK);
 }
 
-string_t *readFiles(string_t *str, char *filename)
+int proj1SaveSnapshot(proj1_t *ctx, const char *path)
 {
-	FILE *fp;
-	int fLen, i, j = str->length;
-	char *tmp = str->charAt;
+	jmp_buf failed;
+	int status;
 
-	if (!(fp = fopen(filename, "r")))
-	{
-		WARN("%s%s%s", "Unable to open file ", filename, "!\n");
-		return str;
-	}
-
-	// Get the length of the file
-	fLen = getFileLength(fp);
-
-	// Allocate memory to save file into memory
-	str->length += fLen;
-	str->charAt = calloc(str->length + 1, sizeof(char));
+	if ((status = setjmp(failed)))
+		return leave(ctx, status);
 
-	for (i = 0; i < j; i++)
-		str->charAt[i] = tmp[i];
-	free(tmp);
-
-	// Read contents of file into str
-	fread(str->charAt + j, sizeof(char), fLen, fp);
+	enter(ctx, &failed);
+	saveSnapshot(ctx->macros, path);
 
-	return str;
+	return leave(ctx, PROJ1_OK);
 }
 
-int main(int argc, char *argv[])
+proj1_image_t *proj1MapSnapshot(proj1_t *ctx, const char *path)
 {
-	int i;
-	char *tmp, *tmp1;
-	string_t *str;
-	macrolist_t *macros = initMacros();
-	stack_t *stack = createStack();
-	stack_t *out = createStack();
-	stack_t *finalOutput = createStack();
+	jmp_buf failed;
+	image_t *img;
 
-	// Read from stdin
-	if (argc == 1)
-	{
-		str = readStdin();
-	}
-	else
+	if (setjmp(failed))
 	{
-		str = readFile(argv[1]);
-		for (i = 2; i < argc; i++)
-			str = readFiles(str, argv[i]);
+		leave(ctx, PROJ1_ERROR);
+		return NULL;
 	}
 
-	chunkString(str, stack);
-	processChunks(stack, macros, out);
+	enter(ctx, &failed);
+	img = mapSnapshot(path);
+	leave(ctx, PROJ1_OK);
 
-	flipStack(out, finalOutput);
+	return img;
+}
 
-	while (finalOutput->head)
-	{
-		tmp = pop(finalOutput);
-			tmp1 = escAll(tmp);
-		fprintf(stdout, "%s", tmp1);
-		free(tmp);
-		free(tmp1);
-		fflush(stdout);
-	}
+int proj1LoadSnapshot(proj1_t *ctx, proj1_image_t *image)
+{
+	jmp_buf failed;
+	int status;
 
-	destroyStack(out);
-	destroyStack(stack);
-	destroyStack(finalOutput);
-	destroyString(str);
-	destroyMacros(macros);
+	if ((status = setjmp(failed)))
+		return leave(ctx, status);
 
-	return 0;
-}
\ No newline at end of file
+	enter(ctx, &failed);
+	loadSnapshot(ctx->macros, image);
+
+	return leave(ctx, PROJ1_OK);
+}
+
+proj1_image_t *proj1UnmapSnapshot(proj1_image_t *image)
+{
+	return unmapSnapshot(image);
+}
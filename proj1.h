@@ -0,0 +1,116 @@
+#ifndef PROJ1_H
+#define PROJ1_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// The macro processor as a library. A context holds a macro table, the
+// \include cache, the allocators and the limits; documents expanded in
+// it define into (and use) its table. Nothing is shared between
+// contexts, except by a clone with the context it was cloned from. A
+// context (and its clones) is only used by one thread at a time.
+//
+// Nothing exits or prints: a call that fails returns a status other
+// than PROJ1_OK, and proj1Error says why. The context stays usable,
+// with whatever was defined before the failure.
+
+#define PROJ1_OK 0
+#define PROJ1_ERROR 1				// a bad document (or a file it needs)
+#define PROJ1_LIMIT 2				// a limit was reached
+#define PROJ1_OUTPUT 3				// the write callback gave up
+
+#define PROJ1_IOV 64				// most iovecs given to a write callback
+
+typedef struct proj1 proj1_t;
+typedef struct proj1image proj1_image_t;
+
+// Output, in place: count pieces, valid only during the call. Returns 0
+// once they are all written, anything else stops the expansion.
+typedef int (*proj1_write_t)(void *user, const struct iovec *iov, int count);
+
+// Input: up to len bytes into buf. Returns how many, 0 at the end and
+// -1 on an error (which is reported and ends the input).
+typedef ssize_t (*proj1_read_t)(void *user, char *buf, size_t len);
+
+// Warnings and errors as they happen, a line each (newline included)
+typedef void (*proj1_report_t)(void *user, const char *message);
+
+// A span of the expansion as it ends: a Chrome trace event (a complete
+// "X" event, as a JSON object), valid only during the call
+typedef void (*proj1_trace_t)(void *user, const char *event);
+
+// 0 for no limit
+typedef struct
+{
+	long expansions;		// macro invocations
+	long stackBytes;		// pending expansion
+	int includeDepth;
+	long timeMs;			// per call
+} proj1_limits_t;
+
+proj1_t *proj1Create(void);
+
+// A context that starts out with base's macros (sharing their bodies),
+// its \include cache and its allocators. base must outlive it.
+proj1_t *proj1Clone(proj1_t *base);
+
+proj1_t *proj1Destroy(proj1_t *ctx);
+
+void proj1SetLimits(proj1_t *ctx, const proj1_limits_t *limits);
+void proj1SetReport(proj1_t *ctx, proj1_report_t report, void *user);
+void proj1SetStats(proj1_t *ctx, int enabled);
+
+// Trace every macro invocation (for as long as what it expanded to is
+// being expanded), \include, \expandafter's expansion of its first
+// argument, the lexing, the writes and the documents. Spans shorter than
+// minUs microseconds are left out. A clone traces as its base does;
+// NULL stops tracing.
+void proj1SetTrace(proj1_t *ctx, proj1_trace_t trace, void *user, long minUs);
+
+// Keep the output of documents expanded from files in dir, with what
+// each depended on: the macros it looked up (defined or not, and to
+// what) and the files it \included. A later call with the same files,
+// while all of those are still the same, writes the output kept out
+// instead of expanding (and so defines nothing). Nothing is kept while
+// limits are set, or of a document that warned. A clone keeps where its
+// base does; NULL stops caching.
+void proj1SetCache(proj1_t *ctx, const char *dir);
+
+// Remove the least recently used of the cache's files until the rest
+// take at most maxBytes
+int proj1TrimCache(proj1_t *ctx, long maxBytes);
+
+// Expand a document read from a single (large) file on up to threads
+// threads, 1 (the default) for just the caller's. It is cut into
+// segments after newlines outside any group, and a wave of them at a
+// time is expanded ahead in parallel, each on its own from the table
+// as the wave started. In order, a segment is then written out (and
+// its definitions made) if what it looked up is still what it found,
+// or expanded again if an earlier one defined or undefined any of it:
+// the output is the same either way, up to how much of it is flushed
+// before an error. Only for a call with no stats, trace or limits,
+// that is not keeping its document in the cache. A clone expands on
+// just its caller's thread.
+void proj1SetParallel(proj1_t *ctx, int threads);
+
+// Expand a document (data, what read returns, the files one after the
+// other) into write
+int proj1ExpandBuffer(proj1_t *ctx, const char *data, size_t len, proj1_write_t write, void *user);
+int proj1ExpandStream(proj1_t *ctx, proj1_read_t read, void *readUser, proj1_write_t write, void *user);
+int proj1ExpandFiles(proj1_t *ctx, char **files, int count, proj1_write_t write, void *user);
+
+// Why the last call failed, "" if it did not
+const char *proj1Error(proj1_t *ctx);
+
+// What proj1SetStats has counted so far, as text or JSON
+int proj1PrintStats(proj1_t *ctx, FILE *fp, int json);
+
+// Images of a macro table. A mapped image can be loaded into any number
+// of contexts (on any thread), and must outlive them.
+int proj1SaveSnapshot(proj1_t *ctx, const char *path);
+proj1_image_t *proj1MapSnapshot(proj1_t *ctx, const char *path);
+int proj1LoadSnapshot(proj1_t *ctx, proj1_image_t *image);
+proj1_image_t *proj1UnmapSnapshot(proj1_image_t *image);
+
+#endif
@@ -0,0 +1,69 @@
+#!/bin/sh
+# Which arguments are whole groups: the brace index and the lexer's
+# flags only save going over an argument again, they must not change
+# what is taken. Braces after an ESCAPE do not count, so a brace after
+# an escaped ESCAPE (\\{) does not either, at any depth. Each document
+# is expanded from a file and from a pipe, and gives the output (or the
+# error) after it.
+#
+#     tests/args.sh
+#
+# CC and CFLAGS are used for the build.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+$CC $CFLAGS -pthread -o "$dir/proj1" main.c proj1.c
+
+status=0
+count=0
+bad='proj1: Bad argument(s) for custom macro'
+
+check()
+{
+	printf '%s' "$1" > "$dir/doc"
+
+	for from in file pipe
+	do
+		if [ $from = file ]
+		then
+			"$dir/proj1" "$dir/doc" > "$dir/got" 2>&1 || true
+		else
+			"$dir/proj1" < "$dir/doc" > "$dir/got" 2>&1 || true
+		fi
+
+		if [ "$(cat "$dir/got")" != "$2" ]
+		then
+			printf '%s from a %s: %s, not %s\n' "$1" $from "$(cat "$dir/got")" "$2"
+			status=1
+		fi
+	done
+
+	count=$((count + 1))
+}
+
+check '\def{A}{[#]}\A{\}' '[\]'
+check '\def{A}{[#]}\A{#\\}' '[#\]'
+check '\def{A}{[#]}\A{a\\}b}' '[a\]b}'
+check '\def{A}{[#]}\A{\\{}}' "$bad"
+check '\def{A}{[#]}\A{{{{{a}}}}}' '[{{{{a}}}}]'
+check '\def{A}{[#]}\A{{{{{a\\\{}}}}}}' '[{{{{a\{}}}}]}'
+check '\def{A}{[#]}\A{{{{{a\\{}}}}}}' "$bad"
+check '\def{A}{[#]}\A{{{{{a\\}}}}}}}' "$bad"
+check '\def{A}{[#]}\A{{{{{a\\}{}}}}}}' "$bad"
+check '\def{A}{[#]}\A{%x
+{{{{a\\{}}}}}}' "$bad"
+
+# The argument inside a group, so it is chunked again from the index
+check '\def{A}{[#]}{{\A{{{{{a\\{}}}}}}}}' "$bad"
+check '\def{A}{[#]}{{{{{{\A{{{{{a\\{}}}}}}}}}}}}' "$bad"
+check '\def{A}{[#]}{{{{{{\A{{{{{a\\\{}}}}}}}}}}}}}' '{{{{{{[{{{{a\{}}}}]}}}}}}}}'
+
+echo "$count documents, $([ $status = 0 ] && echo right || echo WRONG)"
+exit $status
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "proj1.h"
+
+// Documents that fail part of the way through (inside nested
+// \expandafters, in an \include, at a limit, in the output) expanded
+// over and over on one context: the memory in use and the number of
+// mappings of the document's file must not keep growing. Built with
+// -fsanitize=address (and -DNO_POOLS, so the pools hide nothing) its
+// leak report at exit stands in for the measure of the memory, which
+// the sanitizer's allocator throws off. See tests/leaks.sh.
+
+#if defined(__SANITIZE_ADDRESS__)
+#define MEASURE_MEMORY 0
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define MEASURE_MEMORY 0
+#endif
+#endif
+#ifndef MEASURE_MEMORY
+#define MEASURE_MEMORY 1
+#endif
+
+#define WARMUP 500					// calls before the first measure
+#define ROUNDS (MEASURE_MEMORY ? 5000 : 100)	// calls between the measures
+#define GROWTH_MAX (512 * 1024)		// bytes of resident memory allowed to grow
+
+typedef struct
+{
+	char *name;
+	char *prelude;			// expanded once, before the limit is set
+	char *doc;
+	long expansions;		// limit, 0 for none
+	int failWrite;			// the write callback gives up
+	int file;				// expanded from a file (mapped) rather than a buffer
+	int status;				// expected
+} case_t;
+
+int writeNothing(void *user, const struct iovec *iov, int count);
+int failWrite(void *user, const struct iovec *iov, int count);
+long resident(void);
+long mappings(char *path);
+int expandCase(proj1_t *ctx, case_t *c, char *path);
+int runCase(case_t *c, char *path);
+
+// Output long and escaped enough to go past the staging buffer, filled
+// in by main
+static char big[256 * 1024];
+
+static case_t cases[] = {
+	{ "nested", "", "\\expandafter{after}{xx\\nosuch{}}", 0, 0, 0, PROJ1_ERROR },
+	{ "nested twice", "\\def{A}{\\expandafter{#}{\\expandafter{y}{z\\B{}}}}", "\\A{x}", 0, 0, 0, PROJ1_ERROR },
+	{ "nested include", "", "\\expandafter{a}{\\include{/nonexistent/proj1}}", 0, 0, 0, PROJ1_ERROR },
+	{ "nested limit", "\\def{R}{r\\R{}}", "\\expandafter{a}{\\R{}}", 100, 0, 0, PROJ1_LIMIT },
+	{ "nested file", "", "text\n\\expandafter{after}{xx\\nosuch{}}\n", 0, 0, 1, PROJ1_ERROR },
+	{ "output", "", big, 0, 1, 0, PROJ1_OUTPUT },
+	{ "output file", "", big, 0, 1, 1, PROJ1_OUTPUT },
+};
+
+int writeNothing(void *user, const struct iovec *iov, int count)
+{
+	(void) user;
+	(void) iov;
+	(void) count;
+
+	return 0;
+}
+
+int failWrite(void *user, const struct iovec *iov, int count)
+{
+	(void) user;
+	(void) iov;
+	(void) count;
+
+	return 1;
+}
+
+// Bytes of the process in memory
+long resident(void)
+{
+	FILE *fp = fopen("/proc/self/statm", "r");
+	long size, pages = 0;
+
+	if (fp && fscanf(fp, "%ld %ld", &size, &pages) != 2)
+		pages = 0;
+
+	if (fp)
+		fclose(fp);
+
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+// Of the file at path
+long mappings(char *path)
+{
+	FILE *fp = fopen("/proc/self/maps", "r");
+	char line[4096];
+	long count = 0;
+
+	if (!fp)
+		return 0;
+
+	while (fgets(line, sizeof(line), fp))
+		count += strstr(line, path) != NULL;
+
+	fclose(fp);
+
+	return count;
+}
+
+int expandCase(proj1_t *ctx, case_t *c, char *path)
+{
+	proj1_write_t write = c->failWrite ? failWrite : writeNothing;
+	int status;
+
+	if (c->file)
+		status = proj1ExpandFiles(ctx, &path, 1, write, NULL);
+	else status = proj1ExpandBuffer(ctx, c->doc, strlen(c->doc), write, NULL);
+
+	if (status != c->status)
+	{
+		printf("%s: status %d, not %d (%s)\n", c->name, status, c->status, proj1Error(ctx));
+		return 1;
+	}
+
+	return 0;
+}
+
+int runCase(case_t *c, char *path)
+{
+	proj1_limits_t limits = { c->expansions, 0, 0, 0 };
+	proj1_t *ctx = proj1Create();
+	long memory, maps;
+	int i, failed = 0;
+	FILE *fp;
+
+	if (!ctx)
+		return 1;
+
+	if (proj1ExpandBuffer(ctx, c->prelude, strlen(c->prelude), writeNothing, NULL))
+	{
+		printf("%s: prelude failed (%s)\n", c->name, proj1Error(ctx));
+		proj1Destroy(ctx);
+		return 1;
+	}
+
+	proj1SetLimits(ctx, &limits);
+
+	if (c->file && (!(fp = fopen(path, "w")) || fputs(c->doc, fp) < 0 || fclose(fp)))
+	{
+		printf("%s: unable to write %s\n", c->name, path);
+		proj1Destroy(ctx);
+		return 1;
+	}
+
+	for (i = 0; i < WARMUP && !failed; i++)
+		failed = expandCase(ctx, c, path);
+
+	memory = resident();
+	maps = mappings(path);
+
+	for (i = 0; i < ROUNDS && !failed; i++)
+		failed = expandCase(ctx, c, path);
+
+	if (!failed && MEASURE_MEMORY && resident() - memory > GROWTH_MAX)
+	{
+		printf("%s: %ld bytes more in memory after %d calls\n", c->name, resident() - memory, ROUNDS);
+		failed = 1;
+	}
+
+	if (!failed && mappings(path) != maps)
+	{
+		printf("%s: %ld mappings of the document, %ld before\n", c->name, mappings(path), maps);
+		failed = 1;
+	}
+
+	proj1Destroy(ctx);
+
+	return failed;
+}
+
+int main(void)
+{
+	char path[] = "/tmp/proj1-leaks-XXXXXX";
+	int fd, i, failed = 0;
+	size_t len;
+
+	// The sanitizer's leak report exits without flushing
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	strcpy(big, "\\expandafter{");
+
+	for (len = strlen(big); len < sizeof(big) - 64; len += 3)
+		memcpy(big + len, len / 3 % 8 ? "ab " : "\\\\ ", 3);
+
+	strcpy(big + len, "}{x}");
+
+	if ((fd = mkstemp(path)) < 0)
+	{
+		printf("unable to create %s\n", path);
+		return 1;
+	}
+
+	close(fd);
+
+	for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++)
+		failed |= runCase(cases + i, path);
+
+	unlink(path);
+	printf("%s\n", failed ? "leaks" : "no leaks");
+
+	return failed;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Failed calls let go of everything they held: builds tests/leaks.c
+# against the library as it is, and with -fsanitize=address and
+# -DNO_POOLS when the compiler has the sanitizer, and runs both.
+#
+#     tests/leaks.sh
+#
+# CC and CFLAGS are used for the builds.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+$CC $CFLAGS -pthread -I. -o "$dir/leaks" tests/leaks.c proj1.c
+"$dir/leaks"
+
+if $CC -fsanitize=address -g -DNO_POOLS -pthread -I. -o "$dir/leaks-asan" tests/leaks.c proj1.c 2> /dev/null
+then
+	"$dir/leaks-asan"
+else
+	echo "no -fsanitize=address, skipped the sanitizer build"
+fi
@@ -0,0 +1,119 @@
+#!/bin/sh
+# The vector literal scanners against the byte loop: builds proj1 with
+# -DSCAN_SCALAR, with SSE2 only and with AVX2 (both with -DSCAN_CHECK,
+# which dies on any scan that differs from the byte loop), then expands
+# documents with each special character at every offset from 0 to 63
+# after the start of a scan (across the 16 and 32 byte boundaries), at
+# the very end of the input, and at the end of a page-sized file. The
+# output, the errors and the status must be the same for all three,
+# from a file and from a pipe.
+#
+#     tests/scan.sh
+#
+# CC and CFLAGS are used for the builds.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+$CC $CFLAGS -pthread -DSCAN_SCALAR -o "$dir/scalar" main.c proj1.c
+$CC $CFLAGS -pthread -DSCAN_CHECK -DSCAN_NO_AVX2 -o "$dir/sse2" main.c proj1.c
+$CC $CFLAGS -pthread -DSCAN_CHECK -o "$dir/avx2" main.c proj1.c
+
+mkdir "$dir/in"
+
+# One document per special: a line for each offset k in [0, 64) and
+# each length n in [0, 64) of the literal run after it, so the special
+# lands on every offset of a scan started by the newline before it
+awk -v dir="$dir/in" 'BEGIN {
+	split("\\\\ \\{ \\} \\% { } {} %x \\A{y} \\A{{z}}", special, " ");
+	fill = "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ+-";
+
+	for (t = 1; t in special; t++)
+	{
+		file = dir "/offset" t;
+		printf "\\def{A}{<#>}\n" > file;
+
+		for (k = 0; k < 64; k++)
+			for (n = 0; n < 64; n += 7)
+			{
+				line = substr(fill, 1, k) special[t] substr(fill, 1, n);
+
+				# Unbalanced braces get a partner, comments a line of their own
+				if (special[t] == "{")
+					line = line "}";
+				else if (special[t] == "}")
+					line = "{" line;
+
+				printf "%s\n", line > file;
+			}
+
+		close(file);
+
+		# The special as the last bytes of the input, no newline after it
+		for (k = 0; k < 64; k++)
+		{
+			file = dir "/end" t "_" k;
+			line = substr(fill, 1, k) special[t];
+
+			if (special[t] == "{")
+				line = "{" substr(fill, 1, k) "}";
+			else if (special[t] == "}")
+				line = "{" line;
+
+			printf "\\def{A}{<#>}\n%s", line > file;
+			close(file);
+		}
+	}
+
+	# A page of literal text, then one with a special as its last byte,
+	# so a scan reading past the end of a mapped file would fault
+	for (p = 0; p < 2; p++)
+	{
+		file = dir "/page" p;
+		line = "";
+
+		for (i = 0; i < 4096 - p; i++)
+			line = line substr(fill, i % 64 + 1, 1);
+
+		printf "%s%s", line, p ? "%" : "" > file;
+		close(file);
+	}
+}'
+
+status=0
+count=0
+
+for doc in "$dir"/in/*
+do
+	"$dir/scalar" "$doc" > "$dir/want" 2>&1 && echo 0 >> "$dir/want" || echo $? >> "$dir/want"
+
+	for build in sse2 avx2
+	do
+		"$dir/$build" "$doc" > "$dir/got" 2>&1 && echo 0 >> "$dir/got" || echo $? >> "$dir/got"
+
+		if ! cmp -s "$dir/want" "$dir/got"
+		then
+			echo "$build differs from scalar on $(basename "$doc")"
+			status=1
+		fi
+
+		cat "$doc" | "$dir/$build" > "$dir/got" 2>&1 && echo 0 >> "$dir/got" || echo $? >> "$dir/got"
+
+		if ! cmp -s "$dir/want" "$dir/got"
+		then
+			echo "$build differs from scalar on $(basename "$doc") from a pipe"
+			status=1
+		fi
+	done
+
+	count=$((count + 1))
+done
+
+echo "$count documents, $([ $status = 0 ] && echo same || echo DIFFERENT)"
+exit $status